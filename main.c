@@ -2,38 +2,87 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <time.h>
+#include <stddef.h>
+#include <limits.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <setjmp.h>
+#ifndef TLISP_NO_MAIN
 #include <editline/readline.h>
 #include <editline/history.h>
+#endif
 
 struct lval;
 struct lenv;
+struct lcode;
+struct lnode;
+struct ljit;
 typedef struct lval lval;
 typedef struct lenv lenv;
+typedef struct lcode lcode;
+typedef struct lnode lnode;
+typedef struct ljit ljit;
 
 typedef lval *(*lbuiltin)(lenv *, lval *);
 
+#define LVAL_SMALL 4
+
+/* Only the payload of the value's type is allocated, see lval_size */
 typedef struct lval {
-  int type;
+  unsigned char type;
+  char mark;
+  char old;
+  char remembered;
+  int ref;
+  struct lval *next;
 
-  /* Basic */
-  long num;
-  char *err;
-  char *sym;
+  union {
+    /* Basic */
+    long num;
+    char *err;
+    struct {
+      int atom;
+      int depth;
+      int slot;
+      unsigned int cached;    // lglobal_version global was resolved at
+      struct lval **global;   // global's cell in the root env
+    };
 
-  /* Function */
-  lbuiltin builtin;
-  lenv *env;
-  lval *formals;
-  lval *body;
-  
-  /* Expression */
-  int count;
-  struct lval **cell;
+    /* Function */
+    struct {
+      lbuiltin builtin;
+      lenv *env;
+      lval *formals;
+      lval *body;
+      lcode *code;
+      int arity;     // formals taken one argument each, -1 if irregular
+      int variadic;  // formals end in '& rest'
+      int calls;     // tiered: calls so far while interpreted
+    };
+
+    /* Partial application: a lambda and the args bound so far, put in
+       front of those of the next call */
+    struct {
+      struct lval *fun;
+      struct lval *args;
+    };
+
+    /* Expression: cell points start slots into an allocation of
+       capacity slots, so popping the front just moves it along. Up to
+       LVAL_SMALL cells are kept in small, inside the lval itself. */
+    struct {
+      int count;
+      int start;
+      int capacity;
+      struct lval **cell;
+      struct lval *small[LVAL_SMALL];
+    };
+  };
 } lval;
 
 lenv *lenv_new();
-void lenv_del(lenv *e);
-lenv *lenv_copy(lenv *e);
 
 void lval_print(lval *v);
 lval *lval_eval(lenv *e, lval *v);
@@ -41,6 +90,25 @@ lval *lval_add_cell(lval *v, lval *a);
 
 lval *builtin_eval(lenv *e, lval *arg);
 lval *builtin_list(lenv *e, lval *arg);
+lval *builtin_add(lenv *e, lval *arg);
+lval *builtin_sub(lenv *e, lval *arg);
+lval *builtin_mul(lenv *e, lval *arg);
+lval *builtin_div(lenv *e, lval *arg);
+lval *builtin_head(lenv *e, lval *arg);
+lval *builtin_tail(lenv *e, lval *arg);
+lval *builtin_join(lenv *e, lval *arg);
+lval *builtin_def(lenv *e, lval *arg);
+lval *builtin_lambda(lenv *e, lval *arg);
+
+lcode *lcode_compile(lval *v);
+void lcode_del(lcode *c);
+lval *lvm_run(lenv *e, lcode *c);
+lnode *lnode_compile_sexpr(lcode *c, lval *v, int tail);
+void lnode_free(lnode *n);
+lval *lnode_run(lenv *e, lcode *c);
+ljit *ljit_compile(lval *fun);
+void ljit_free(ljit *j);
+lval *ljit_run(lval *fun, lval **args, lenv *frame);
 
 enum {
   LVAL_NUM,
@@ -49,36 +117,671 @@ enum {
   LVAL_SEXPR,
   LVAL_QEXPR,
   LVAL_ERR,
+  LVAL_PART,
 };
 
+#define LVAL_SIZE(field) \
+  ((offsetof(lval, field) + sizeof(((lval *)0)->field) + 7) & ~(size_t)7)
+
+size_t lval_size(int type) {
+  switch (type) {
+  case LVAL_NUM: return LVAL_SIZE(num);
+  case LVAL_ERR: return LVAL_SIZE(err);
+  case LVAL_SYM: return LVAL_SIZE(global);
+  case LVAL_FUN: return LVAL_SIZE(calls);
+  case LVAL_PART: return LVAL_SIZE(args);
+  default: return LVAL_SIZE(small);
+  }
+}
+
+/* Small integers are immediate: the pointer itself holds the number,
+   shifted left with the low bit set, so they are never allocated,
+   counted or collected. Use lval_type and lval_get_num on any value
+   that may be a number. */
+#define LVAL_FIXNUM(v) (((uintptr_t)(v) & 1) != 0)
+#define LFIXNUM_MIN (LONG_MIN >> 1)
+#define LFIXNUM_MAX (LONG_MAX >> 1)
+
+int lval_type(lval *v) {
+  return LVAL_FIXNUM(v) ? LVAL_NUM : v->type;
+}
+
+long lval_get_num(lval *v) {
+  return LVAL_FIXNUM(v) ? (long)((intptr_t)v >> 1) : v->num;
+}
+
 typedef struct lenv {
+  char mark;
+  char remembered;
+  lenv *next;
+
   lenv *parent;
   int count;
-  char **syms;
+  int *syms;
   lval **vals;
+
+  /* Open-addressing index from atom id to slot, built once the
+     frame outgrows a linear scan */
+  int *index;
+  int index_size;
 } lenv;
 
+#define LENV_LINEAR_MAX 16
+
+/* Symbol intern table: every distinct name is stored once and
+   symbols carry its index (atom id) */
+char **latom_names = NULL;
+int latom_count = 0;
+int latom_capacity = 0;
+int *latom_index = NULL;
+int latom_index_size = 0;
+
+int latom_amp = -1;
+
+/* Atoms ever bound outside the root env, as formals or by '='. Only
+   references to the others can be cached, as nothing shadows them. */
+char *latom_local = NULL;
+
+/* Atoms of constants, made by 'const'. They are never bound again, so
+   lambdas made later can take their values as given, see lval_inline. */
+char *latom_const = NULL;
+
+/* Symbols cache the root env cell they resolved to, valid while
+   lglobal_version is unchanged. It moves on whenever a cell could:
+   the root env grows or is freed, or an atom becomes local. */
+unsigned int lglobal_version = 1;
+
+unsigned int latom_hash(char const *name) {
+  unsigned int h = 2166136261u;
+  for (; *name; name++) {
+    h = (h ^ (unsigned char)*name) * 16777619u;
+  }
+  return h;
+}
+
+int latom_intern(char const *name) {
+  if (latom_count * 2 >= latom_index_size) {
+    latom_index_size = latom_index_size ? latom_index_size * 2 : 256;
+    free(latom_index);
+    latom_index = malloc(sizeof(int) * latom_index_size);
+    for (int i = 0; i < latom_index_size; i++) {
+      latom_index[i] = -1;
+    }
+    for (int i = 0; i < latom_count; i++) {
+      unsigned int h = latom_hash(latom_names[i]) & (latom_index_size - 1);
+      while (latom_index[h] >= 0) {
+        h = (h + 1) & (latom_index_size - 1);
+      }
+      latom_index[h] = i;
+    }
+  }
+
+  unsigned int h = latom_hash(name) & (latom_index_size - 1);
+  while (latom_index[h] >= 0) {
+    if (strcmp(latom_names[latom_index[h]], name) == 0) {
+      return latom_index[h];
+    }
+    h = (h + 1) & (latom_index_size - 1);
+  }
+
+  if (latom_count == latom_capacity) {
+    latom_capacity = latom_capacity ? latom_capacity * 2 : 128;
+    latom_names = realloc(latom_names, sizeof(char *) * latom_capacity);
+    latom_local = realloc(latom_local, latom_capacity);
+    latom_const = realloc(latom_const, latom_capacity);
+  }
+  latom_local[latom_count] = 0;
+  latom_const[latom_count] = 0;
+  latom_names[latom_count] = malloc(strlen(name) + 1);
+  strcpy(latom_names[latom_count], name);
+  latom_index[h] = latom_count;
+  return latom_count++;
+}
+
+char const *latom_name(int atom) {
+  return latom_names[atom];
+}
+
+void latom_bind_local(int atom) {
+  if (!latom_local[atom]) {
+    latom_local[atom] = 1;
+    lglobal_version++;
+  }
+}
+
+enum {
+  LENGINE_TREE,
+  LENGINE_VM,
+  LENGINE_CLOSURE,
+  LENGINE_TIERED,
+};
+
+int lengine = LENGINE_TREE;
+
+/* Bytecode: low 8 bits opcode, upper 24 bits operand */
+enum {
+  OP_CONST,
+  OP_LOAD,
+  OP_NIL,
+  OP_CALL,
+  OP_TAIL,
+  OP_RETURN,
+  OP_FOLD,    // the value at arg while lfold_valid, else run on
+};
+
+#define OP_CODE(i) ((i) & 0xff)
+#define OP_ARG(i) ((int)((i) >> 8))
+#define OP_MAKE(op, arg) ((unsigned int)(op) | ((unsigned int)(arg) << 8))
+
+typedef struct lcode {
+  int ref;
+  int count;
+  int capacity;
+  unsigned int *ops;
+  int depth;
+  int max_depth;
+  lval *consts;
+  lnode *node;  // closure engine: the expression as a tree of nodes
+  ljit *jit;    // tiered: native code of a hot numeric lambda
+} lcode;
+
+/* Closure engine: each expression is compiled once into a node that
+   evaluates itself through its run function, on operands resolved at
+   compile time, instead of dispatching on the type of every cell */
+typedef lval *(*lnode_fn)(lnode *n, lenv *e, lval **consts);
+
+typedef struct lnode {
+  lnode_fn run;
+  int arg;           // consts index of a constant or symbol, op of +-*/
+  int tail;          // call in tail position of the code
+  lbuiltin builtin;  // arithmetic: the builtin the op names
+  int count;
+  lnode **cells;     // call: the function, then its arguments
+} lnode;
+
+/* Native code of a lambda, see ljit_compile */
+#define LJIT_ARGS 8
+#define LJIT_GLOBALS 8
+
+typedef struct ljit {
+  int (*entry)(long *args, long *out, long budget);
+  void *mem;
+  size_t size;
+  int recurses;                        // has self calls not in tail position
+  int off;                             // not worth running any more
+
+  // the globals the code takes as given: each atom is bound to a
+  // builtin, or to the lambda itself where builtin is NULL
+  int count;
+  int atoms[LJIT_GLOBALS];
+  lbuiltin builtins[LJIT_GLOBALS];
+  lval **cells[LJIT_GLOBALS];
+  unsigned int version;                // lglobal_version of cells
+} ljit;
+
+lval **lvm_stack = NULL;
+int lvm_sp = 0;
+int lvm_capacity = 0;
+
+/* Evaluation frames of both engines live on the heap rather than the
+   C stack, so recursion depth is bounded by lstack_limit bytes */
+typedef struct lframe {
+  lenv *e;
+  lval *fun;    // function whose frame e is, once a call entered one
+  lval *v;      // tree: expression whose cells are evaluated; vm: consts
+  int i;        // tree: next cell; vm: offset of the next op
+  int base;     // vm: value stack base
+  lcode *code;  // vm: code running in the frame
+  lcode *own;   // vm: code compiled for eval, released with the frame
+} lframe;
+
+lframe *lstack = NULL;
+int lstack_sp = 0;
+int lstack_capacity = 0;
+long lstack_limit = 64 * 1024 * 1024;
+
+/* Slab allocator: old-space lvals, lenvs and the arrays they own are
+   carved out of LSLAB_SIZE aligned slabs, one size class per slab, so
+   the slab an object belongs to is found by masking its address. Each
+   slab keeps its own free list. Slabs left with nothing in use are kept
+   for reuse, and those beyond lslab_reserve go back to the system after
+   a collection. Arrays larger than the biggest class use malloc. */
+#define LSLAB_SIZE 65536
+#define LSLAB_CLASSES 14
+
+typedef struct lslab {
+  struct lslab *prev;
+  struct lslab *next;
+  int size_class;
+  int used;
+  void *free;
+} lslab;
+
+typedef struct {
+  int size;
+  lslab *partial;  // slabs with free objects
+  long slabs;
+  long used;
+} lslab_class;
+
+lslab_class lslab_classes[LSLAB_CLASSES] = {
+  {8}, {16}, {24}, {32}, {40}, {48}, {64}, {72}, {96}, {128}, {256},
+  {512}, {1024}, {2048},
+};
+
+lslab *lslab_empty = NULL;
+int lslab_nempty = 0;
+int lslab_reserve = 16;
+long lslab_mapped = 0;
+long lslab_released = 0;
+
+#define LSLAB_HEADER ((sizeof(lslab) + 15) & ~(size_t)15)
+
+lslab *lslab_new(int c) {
+  lslab *s = lslab_empty;
+  if (s) {
+    lslab_empty = s->next;
+    lslab_nempty--;
+  } else {
+    // map twice the size and trim it down to an aligned slab
+    char *p = mmap(NULL, 2 * LSLAB_SIZE, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+      perror("mmap");
+      exit(1);
+    }
+    char *a = (char *)(((uintptr_t)p + LSLAB_SIZE - 1)
+                       & ~(uintptr_t)(LSLAB_SIZE - 1));
+    if (a > p) {
+      munmap(p, a - p);
+    }
+    munmap(a + LSLAB_SIZE, p + LSLAB_SIZE - a);
+    s = (lslab *)a;
+    lslab_mapped++;
+  }
+
+  int size = lslab_classes[c].size;
+  s->size_class = c;
+  s->used = 0;
+  s->free = NULL;
+  for (char *o = (char *)s + LSLAB_SIZE - size;
+       o >= (char *)s + LSLAB_HEADER; o -= size) {
+    *(void **)o = s->free;
+    s->free = o;
+  }
+
+  s->prev = NULL;
+  s->next = lslab_classes[c].partial;
+  if (s->next) {
+    s->next->prev = s;
+  }
+  lslab_classes[c].partial = s;
+  lslab_classes[c].slabs++;
+  return s;
+}
+
+void lslab_unlink(lslab *s) {
+  if (s->prev) {
+    s->prev->next = s->next;
+  } else {
+    lslab_classes[s->size_class].partial = s->next;
+  }
+  if (s->next) {
+    s->next->prev = s->prev;
+  }
+}
+
+void *lslab_alloc(int c) {
+  lslab *s = lslab_classes[c].partial;
+  if (!s) {
+    s = lslab_new(c);
+  }
+  void *o = s->free;
+  s->free = *(void **)o;
+  s->used++;
+  lslab_classes[c].used++;
+  if (!s->free) {
+    lslab_unlink(s);
+  }
+  return o;
+}
+
+void lslab_free(void *o) {
+  lslab *s = (lslab *)((uintptr_t)o & ~(uintptr_t)(LSLAB_SIZE - 1));
+  lslab_class *c = &lslab_classes[s->size_class];
+  if (!s->free) {
+    s->prev = NULL;
+    s->next = c->partial;
+    if (s->next) {
+      s->next->prev = s;
+    }
+    c->partial = s;
+  }
+  *(void **)o = s->free;
+  s->free = o;
+  s->used--;
+  c->used--;
+
+  // a class keeps its last slab with room, or one object coming and
+  // going would rebuild a free list each time
+  if (s->used == 0 && (c->partial != s || s->next)) {
+    lslab_unlink(s);
+    c->slabs--;
+    s->next = lslab_empty;
+    lslab_empty = s;
+    lslab_nempty++;
+  }
+}
+
+/* Hand the empty slabs beyond the reserve back to the system, called
+   once a collection has freed a batch of objects */
+void lslab_trim(void) {
+  while (lslab_nempty > lslab_reserve) {
+    lslab *s = lslab_empty;
+    lslab_empty = s->next;
+    lslab_nempty--;
+    munmap(s, LSLAB_SIZE);
+    lslab_mapped--;
+    lslab_released++;
+  }
+}
+
+int lslab_class_of(size_t size) {
+  int c = 0;
+  while (c < LSLAB_CLASSES && (size_t)lslab_classes[c].size < size) {
+    c++;
+  }
+  return c;
+}
+
+void lmem_exhausted(void) {
+  perror("malloc");
+  exit(1);
+}
+
+void *lmem_alloc(size_t size) {
+  if (size == 0) {
+    return NULL;
+  }
+  int c = lslab_class_of(size);
+  void *p = c < LSLAB_CLASSES ? lslab_alloc(c) : malloc(size);
+  if (!p) {
+    lmem_exhausted();
+  }
+  return p;
+}
+
+/* size must be the one p was allocated or last resized with */
+void lmem_free(void *p, size_t size) {
+  if (!p) {
+    return;
+  }
+  if (lslab_class_of(size) < LSLAB_CLASSES) {
+    lslab_free(p);
+  } else {
+    free(p);
+  }
+}
+
+void *lmem_resize(void *p, size_t from, size_t to) {
+  int a = p ? lslab_class_of(from) : -1;
+  int b = to ? lslab_class_of(to) : -1;
+  if (a == b && a < LSLAB_CLASSES) {
+    return p;
+  }
+  if (a == LSLAB_CLASSES && b == LSLAB_CLASSES) {
+    void *q = realloc(p, to);
+    if (!q) {
+      lmem_exhausted();
+    }
+    return q;
+  }
+  void *q = lmem_alloc(to);
+  if (p && q) {
+    memcpy(q, p, from < to ? from : to);
+  }
+  lmem_free(p, from);
+  return q;
+}
+
+void lslab_report(void) {
+  fprintf(stderr, "slabs: %ld mapped, %d empty, %ld returned\n",
+          lslab_mapped, lslab_nempty, lslab_released);
+  for (int c = 0; c < LSLAB_CLASSES; c++) {
+    lslab_class *k = &lslab_classes[c];
+    if (k->slabs) {
+      long capacity = k->slabs * ((LSLAB_SIZE - LSLAB_HEADER) / k->size);
+      fprintf(stderr, "  %5d bytes: %ld slabs, %ld of %ld in use\n",
+              k->size, k->slabs, k->used, capacity);
+    }
+  }
+}
+
+/* Garbage collector: lvals are bump-allocated in a nursery of fixed
+   size chunks. A minor collection copies the survivors into the old
+   space, a list of individually allocated lvals, and leaves a
+   forwarding pointer in next; lenvs always live in the old space.
+   Old objects that get a nursery pointer stored into them are recorded
+   by the write barrier (lgc_write) and scanned as extra roots.
+   A major collection is incremental: it marks the old space in slices
+   bounded by the pause budget, taken whenever a nursery chunk runs out,
+   and new old-space objects are born marked. While marking, the write
+   barrier also shades values stored into marked objects. Marking ends
+   at a safe point that empties the nursery and rescans the roots, and
+   the dead are then swept in slices as well.
+   Reference counts only tell copy-on-write whether a value is shared.
+   Minor collections and the end of marking happen at safe points
+   (lgc_poll) where every value in flight is held in a root the
+   collector can update: the global env, the root stack the evaluators
+   push onto, and the VM value stack. */
+lval *lgc_vals = NULL;
+lenv *lgc_envs = NULL;
+lenv *lgc_global = NULL;
+
+#define LGC_CHUNK (256 * 1024)
+
+char **lgc_chunks = NULL;
+char **lgc_tops = NULL;  // where allocation stopped in each full chunk
+int lgc_nchunks = 0;
+int lgc_chunk = -1;
+int lgc_nursery_chunks = 8;
+char *lgc_top = NULL;
+char *lgc_limit = NULL;
+
+lval **lgc_remembered = NULL;
+int lgc_nremembered = 0;
+int lgc_remembered_capacity = 0;
+lenv **lgc_remembered_envs = NULL;
+int lgc_nremembered_envs = 0;
+int lgc_remembered_envs_capacity = 0;
+
+lval ***lgc_roots = NULL;
+int lgc_nroots = 0;
+int lgc_roots_capacity = 0;
+
+long lgc_bytes = 0;
+long lgc_nursery_bytes = 0;  // cell arrays of nursery lists, see lval_reserve
+long lgc_debt = 0;  // bytes allocated or promoted since the last slice
+long lgc_threshold = 8 * 1024 * 1024;
+long lgc_next = 8 * 1024 * 1024;
+int lgc_stats = 0;
+int lgc_collections = 0;
+int lgc_minor_collections = 0;
+
+enum { LGC_IDLE, LGC_MARK, LGC_SWEEP };
+
+int lgc_phase = LGC_IDLE;
+long lgc_budget = 1000;  // microseconds per pause, 0 for stop-the-world
+
+// pause histogram: bucket i counts pauses shorter than 2^i microseconds
+#define LGC_HISTOGRAM 24
+
+long lgc_pauses[LGC_HISTOGRAM];
+long lgc_npauses = 0;
+long lgc_over_budget = 0;
+double lgc_max_pause = 0;
+
+void lgc_step(void);
+
+double ltime_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void lgc_pause(double start) {
+  double us = (ltime_now() - start) * 1e6;
+  int i = 0;
+  while (i < LGC_HISTOGRAM - 1 && us >= (double)(1L << i)) {
+    i++;
+  }
+  lgc_pauses[i]++;
+  lgc_npauses++;
+  if (lgc_budget && us > lgc_budget) {
+    lgc_over_budget++;
+  }
+  if (us > lgc_max_pause) {
+    lgc_max_pause = us;
+  }
+}
+
+void lgc_push(lval **v) {
+  if (lgc_nroots == lgc_roots_capacity) {
+    lgc_roots_capacity = lgc_roots_capacity ? lgc_roots_capacity * 2 : 64;
+    lgc_roots = realloc(lgc_roots, sizeof(lval **) * lgc_roots_capacity);
+  }
+  lgc_roots[lgc_nroots++] = v;
+}
+
+void lgc_pop(int n) {
+  lgc_nroots -= n;
+}
+
 char *ltype_name(int t) {
   switch (t) {
   case LVAL_NUM: return "Number";
   case LVAL_SYM: return "Symbol";
   case LVAL_FUN: return "Function";
+  case LVAL_PART: return "Function";
   case LVAL_SEXPR: return "S-Expression";
   case LVAL_QEXPR: return "Q-Expression";
   default: return "Unknown";
   }
 }
 
+void lgc_nursery_grow(void) {
+  if (lgc_chunk >= 0) {
+    lgc_tops[lgc_chunk] = lgc_top;
+  }
+  lgc_chunk++;
+  if (lgc_chunk == lgc_nchunks) {
+    lgc_chunks = realloc(lgc_chunks, sizeof(char *) * (lgc_nchunks + 1));
+    lgc_tops = realloc(lgc_tops, sizeof(char *) * (lgc_nchunks + 1));
+    lgc_chunks[lgc_nchunks++] = malloc(LGC_CHUNK);
+    if (!lgc_chunks[lgc_nchunks - 1]) {
+      lmem_exhausted();
+    }
+  }
+  lgc_top = lgc_chunks[lgc_chunk];
+  lgc_limit = lgc_top + LGC_CHUNK;
+}
+
+lval *lval_alloc(int type) {
+  size_t size = lval_size(type);
+  if (lgc_top + size > lgc_limit) {
+    if (lgc_phase != LGC_IDLE) {
+      lgc_step();
+    }
+    lgc_nursery_grow();
+  }
+  lval *v = (lval *)lgc_top;
+  lgc_top += size;
+  v->type = type;
+  v->ref = 1;
+  v->mark = 0;
+  v->old = 0;
+  v->remembered = 0;
+  v->next = NULL;
+  return v;
+}
+
+lval *lval_alloc_old(int type) {
+  size_t size = lval_size(type);
+  lval *v = lslab_alloc(lslab_class_of(size));
+  v->type = type;
+  v->ref = 1;
+  v->mark = lgc_phase == LGC_MARK;
+  v->old = 1;
+  v->remembered = 0;
+  v->next = lgc_vals;
+  lgc_vals = v;
+  lgc_bytes += size;
+  return v;
+}
+
+void lgc_shade(lval *v);
+void lgc_shade_env(lenv *e);
+
+/* Write barrier, called when x is stored into v */
+void lgc_write(lval *v, lval *x) {
+  if (LVAL_FIXNUM(x)) {
+    return;
+  }
+  if (lgc_phase == LGC_MARK && v->mark) {
+    lgc_shade(x);
+  }
+  if (!v->old || x->old || v->remembered) {
+    return;
+  }
+  v->remembered = 1;
+  if (lgc_nremembered == lgc_remembered_capacity) {
+    lgc_remembered_capacity =
+      lgc_remembered_capacity ? lgc_remembered_capacity * 2 : 64;
+    lgc_remembered = realloc(lgc_remembered,
+                             sizeof(lval *) * lgc_remembered_capacity);
+  }
+  lgc_remembered[lgc_nremembered++] = v;
+}
+
+void lgc_write_env(lenv *e, lval *x) {
+  if (LVAL_FIXNUM(x)) {
+    return;
+  }
+  if (lgc_phase == LGC_MARK && e->mark) {
+    lgc_shade(x);
+  }
+  if (x->old || e->remembered) {
+    return;
+  }
+  e->remembered = 1;
+  if (lgc_nremembered_envs == lgc_remembered_envs_capacity) {
+    lgc_remembered_envs_capacity =
+      lgc_remembered_envs_capacity ? lgc_remembered_envs_capacity * 2 : 64;
+    lgc_remembered_envs = realloc(lgc_remembered_envs,
+                                  sizeof(lenv *)
+                                  * lgc_remembered_envs_capacity);
+  }
+  lgc_remembered_envs[lgc_nremembered_envs++] = e;
+}
+
+void lgc_write_parent(lenv *e, lenv *parent) {
+  e->parent = parent;
+  if (lgc_phase == LGC_MARK && e->mark) {
+    lgc_shade_env(parent);
+  }
+}
+
 lval *lval_num(long num) {
-  lval *v = malloc(sizeof(lval));
-  v->type = LVAL_NUM;
+  if (num >= LFIXNUM_MIN && num <= LFIXNUM_MAX) {
+    return (lval *)(((uintptr_t)num << 1) | 1);
+  }
+  lval *v = lval_alloc(LVAL_NUM);
   v->num = num;
   return v;
 }
 
 lval *lval_err(char const *format, ...) {
-  lval *v = malloc(sizeof(lval));
-  v->type = LVAL_ERR;
+  lval *v = lval_alloc(LVAL_ERR);
 
   va_list va;
   va_start(va, format);
@@ -93,89 +796,181 @@ lval *lval_err(char const *format, ...) {
 }
 
 lval *lval_sym(char const *sym) {
-  lval *v = malloc(sizeof(lval));
-  v->type = LVAL_SYM;
-  v->sym = malloc(strlen(sym) + 1);
-  strcpy(v->sym, sym);
+  lval *v = lval_alloc(LVAL_SYM);
+  v->atom = latom_intern(sym);
+  v->depth = 0;
+  v->slot = -1;
+  v->cached = 0;
   return v;
 }
 
 lval *lval_fun(lbuiltin builtin) {
-  lval *v = malloc(sizeof(lval));
-  v->type = LVAL_FUN;
+  lval *v = lval_alloc(LVAL_FUN);
   v->builtin = builtin;
   return v;
 }
 
-lval *lval_sexpr(void) {
-  lval *v = malloc(sizeof(lval));
-  v->type = LVAL_SEXPR;
+#define LVAL_IS_SMALL(v) ((v)->cell - (v)->start == (v)->small)
+
+void lval_list_init(lval *v) {
   v->count = 0;
-  v->cell = NULL;
+  v->start = 0;
+  v->capacity = LVAL_SMALL;
+  v->cell = v->small;
+}
+
+lval *lval_sexpr(void) {
+  lval *v = lval_alloc(LVAL_SEXPR);
+  lval_list_init(v);
   return v;
 }
 
 lval *lval_qexpr(void) {
-  lval *v = malloc(sizeof(lval));
-  v->type = LVAL_QEXPR;
-  v->count = 0;
-  v->cell = NULL;
+  lval *v = lval_alloc(LVAL_QEXPR);
+  lval_list_init(v);
   return v;
 }
 
-lval *lval_lambda(lval *formals, lval *body) {
-  lval *v = malloc(sizeof(lval));
-  v->type = LVAL_FUN;
+/* A closure over env, which holds the captured variables and is
+   never changed once made, so copies share it */
+lval *lval_lambda(lenv *env, lval *formals, lval *body) {
+  lval *v = lval_alloc(LVAL_FUN);
   v->builtin = NULL;
-  v->env = lenv_new();
+  v->env = env;
   v->formals = formals;
   v->body = body;
+  v->code = lengine == LENGINE_VM || lengine == LENGINE_CLOSURE
+    ? lcode_compile(body) : NULL;
+  v->calls = 0;
+
+  // calls bind through a fast path unless a name repeats or '&' is
+  // not followed by exactly one name
+  v->arity = formals->count;
+  v->variadic = 0;
+  for (int i = 0; i < formals->count; i++) {
+    int atom = formals->cell[i]->atom;
+    latom_bind_local(atom);
+    if (atom == latom_amp) {
+      v->variadic = 1;
+      v->arity = formals->count == i + 2 ? i : -1;
+    }
+    for (int j = 0; j < i; j++) {
+      if (formals->cell[j]->atom == atom) {
+        v->arity = -1;
+      }
+    }
+  }
   return v;
 }
 
+/* Drop a reference; the collector reclaims the memory */
 void lval_del(lval *v) {
+  if (!LVAL_FIXNUM(v)) {
+    v->ref--;
+  }
+}
+
+/* Release the storage v owns besides itself; children are collected
+   separately */
+void lval_free_fields(lval *v) {
   switch (v->type) {
-  case LVAL_NUM:
-    break;
   case LVAL_FUN:
-    if (!(v->builtin)) {
-      lenv_del(v->env);
-      lval_del(v->formals);
-      lval_del(v->body);
+    if (!(v->builtin) && v->code) {
+      lcode_del(v->code);
     }
     break;
   case LVAL_ERR:
     free(v->err);
     break;
-  case LVAL_SYM:
-    free(v->sym);
-    break;
   case LVAL_SEXPR:
   case LVAL_QEXPR:
-    for (int i = 0; i < v->count; i++) {
-      lval_del(v->cell[i]);
+    if (!LVAL_IS_SMALL(v)) {
+      lmem_free(v->cell - v->start, sizeof(lval *) * v->capacity);
     }
-    free(v->cell);
     break;
   }
-  free(v);
 }
 
 lval *lval_read_num(mpc_ast_t *t) {
+  errno = 0;
   long num = strtol(t->contents, NULL, 10);
   return errno == ERANGE
     ? lval_err("invalid number")
     : lval_num(num);
 }
 
+/* Make room for n cells, reusing the slots popped off the front once
+   they are at least as many as the live ones. Capacity at least
+   doubles, so appending is amortized constant time. */
+void lval_reserve(lval *v, int n) {
+  lval **base = v->cell - v->start;
+  if (v->start > 0 && v->start >= v->count) {
+    memmove(base, v->cell, sizeof(lval *) * v->count);
+    v->cell = base;
+    v->start = 0;
+  }
+  if (v->start + n > v->capacity) {
+    int capacity = v->capacity * 2;
+    if (capacity < v->start + n) {
+      capacity = v->start + n;
+    }
+    // the nursery counts only lval headers, so the arrays of young
+    // lists are counted here; old ones count their cells as they grow
+    if (!v->old) {
+      long bytes = sizeof(lval *)
+        * (base == v->small ? capacity : capacity - v->capacity);
+      lgc_nursery_bytes += bytes;
+      lgc_debt += bytes;
+    }
+    if (base == v->small) {
+      // spill to the heap
+      base = lmem_alloc(sizeof(lval *) * capacity);
+      memcpy(base, v->cell, sizeof(lval *) * v->count);
+      v->start = 0;
+    } else {
+      base = lmem_resize(base, sizeof(lval *) * v->capacity,
+                         sizeof(lval *) * capacity);
+    }
+    v->capacity = capacity;
+    v->cell = base + v->start;
+  }
+}
+
+/* Give back the unused slots once a list is complete, moving short
+   lists back into the lval */
+void lval_shrink(lval *v) {
+  lval **base = v->cell - v->start;
+  if (v->start > 0) {
+    memmove(base, v->cell, sizeof(lval *) * v->count);
+  }
+  v->start = 0;
+  if (base == v->small) {
+    v->cell = base;
+  } else if (v->count <= LVAL_SMALL) {
+    memcpy(v->small, base, sizeof(lval *) * v->count);
+    lmem_free(base, sizeof(lval *) * v->capacity);
+    v->cell = v->small;
+    v->capacity = LVAL_SMALL;
+  } else {
+    v->cell = lmem_resize(base, sizeof(lval *) * v->capacity,
+                          sizeof(lval *) * v->count);
+    v->capacity = v->count;
+  }
+}
+
 lval *lval_add_cell(lval *v, lval *a) {
-  v->cell = realloc(v->cell, sizeof(lval) * (v->count + 1));
+  if (v->old) {
+    lgc_bytes += sizeof(lval *);
+  }
+  lgc_write(v, a);
+  lval_reserve(v, v->count + 1);
   v->cell[v->count] = a;
   v->count++;
   return v;
 }
 
-lval *lval_read(mpc_ast_t *t) {
+/* A number or symbol, or an empty list with room for t's children */
+lval *lval_read_node(mpc_ast_t *t) {
   if (strstr(t->tag, "number")) {
     return lval_read_num(t);
   }
@@ -193,115 +988,240 @@ lval *lval_read(mpc_ast_t *t) {
     v = lval_qexpr();
   }
 
-  for (int i = 0; i < t->children_num; i++) {
-    mpc_ast_t *child = t->children[i];
-    if (strstr(child->tag, "number")
-	|| strstr(child->tag, "symbol")
-	|| strstr(child->tag, "sexpr")
-	|| strstr(child->tag, "expr")) {
-      v = lval_add_cell(v, lval_read(t->children[i]));
-    }
-  }
-
+  // the children include the brackets, shrink once they are read
+  lval_reserve(v, t->children_num);
   return v;
 }
 
-void lval_expr_print(lval const *v, char open, char close) {
-  putchar(open);
-  for (int i = 0; i < v->count; i++) {
-    lval_print(v->cell[i]);
-    if (i < v->count - 1) {
-      putchar(' ');
-    }
-  }
-  putchar(close);
-}
+/* Reads without recursion, keeping the lists being read and the next
+   child of each on a stack */
+lval *lval_read(mpc_ast_t *t) {
+  struct lread { mpc_ast_t *t; lval *v; int i; } *stack = NULL;
+  int sp = 0;
+  int capacity = 0;
 
-void lval_print(lval *v) {
-  switch (v->type) {
-  case LVAL_NUM:
-    printf("%li", v->num);
-    break;
-  case LVAL_ERR:
-    printf("Error: %s", v->err);
-    break;
-  case LVAL_SYM:
-    printf("%s", v->sym);
-    break;
-  case LVAL_FUN:
-    if (v->builtin) {
-      printf("<function>");
+  lval *x = lval_read_node(t);
+  while (1) {
+    if (lval_type(x) == LVAL_SEXPR || lval_type(x) == LVAL_QEXPR) {
+      if (sp == capacity) {
+        capacity = capacity ? capacity * 2 : 16;
+        stack = realloc(stack, sizeof(struct lread) * capacity);
+      }
+      stack[sp].t = t;
+      stack[sp].v = x;
+      stack[sp].i = 0;
+      sp++;
+    } else if (sp == 0) {
+      break;
     } else {
-      printf("(\\ ");
-      lval_print(v->formals);
-      putchar(' ');
-      lval_print(v->body);
-      putchar(')');
+      lval_add_cell(stack[sp - 1].v, x);
     }
-    break;
-  case LVAL_SEXPR:
-    lval_expr_print(v, '(', ')');
-    break;
-  case LVAL_QEXPR:
-    lval_expr_print(v, '{', '}');
-    break;
-  }
-}
-
-void lval_println(lval *v) {
-  lval_print(v);
-  putchar('\n');
-}
 
-lval *lval_pop(lval *v, int i) {
-  lval *x = v->cell[i];
-
-  memmove(&v->cell[i], &v->cell[i + 1],
-	  sizeof(lval*) * (v->count - (i + 1)));
+    // the next child to read, finishing the lists that are done
+    x = NULL;
+    while (sp > 0 && !x) {
+      struct lread *r = &stack[sp - 1];
+      if (r->i == r->t->children_num) {
+        x = r->v;
+        lval_shrink(x);
+        if (--sp > 0) {
+          lval_add_cell(stack[sp - 1].v, x);
+          x = NULL;
+        }
+        continue;
+      }
 
-  v->count--;
-  v->cell = realloc(v->cell, sizeof(lval*) * v->count);
+      mpc_ast_t *child = r->t->children[r->i++];
+      if (strstr(child->tag, "number")
+          || strstr(child->tag, "symbol")
+          || strstr(child->tag, "sexpr")
+          || strstr(child->tag, "expr")) {
+        t = child;
+        x = lval_read_node(t);
+      }
+    }
+    if (sp == 0) {
+      break;
+    }
+  }
+  free(stack);
   return x;
 }
 
-lval *lval_take(lval *v, int i) {
-  lval *x = lval_pop(v, i);
+/* Prints without recursion, keeping the lists being printed and the
+   next cell of each on a stack. A lambda prints as its formals and
+   body in a list of its own. */
+void lval_print(lval *v) {
+  struct lprint { lval *v; int i; } *stack = NULL;
+  int sp = 0;
+  int capacity = 0;
+
+  while (1) {
+    int list = 0;
+    switch (lval_type(v)) {
+    case LVAL_NUM:
+      printf("%li", lval_get_num(v));
+      break;
+    case LVAL_ERR:
+      printf("Error: %s", v->err);
+      break;
+    case LVAL_SYM:
+      printf("%s", latom_name(v->atom));
+      break;
+    case LVAL_FUN:
+      if (v->builtin) {
+        printf("<function>");
+      } else {
+        printf("(\\ ");
+        list = 1;
+      }
+      break;
+    case LVAL_PART:
+      // as the lambda of the formals still unbound
+      printf("(\\ {");
+      for (int i = v->args->count; i < v->fun->formals->count; i++) {
+        printf(i > v->args->count ? " %s" : "%s",
+               latom_name(v->fun->formals->cell[i]->atom));
+      }
+      printf("} ");
+      list = 1;
+      break;
+    case LVAL_SEXPR:
+      putchar('(');
+      list = 1;
+      break;
+    case LVAL_QEXPR:
+      putchar('{');
+      list = 1;
+      break;
+    }
+
+    if (list) {
+      if (sp == capacity) {
+        capacity = capacity ? capacity * 2 : 16;
+        stack = realloc(stack, sizeof(struct lprint) * capacity);
+      }
+      stack[sp].v = v;
+      stack[sp].i = 0;
+      sp++;
+    }
+
+    // the next cell to print, closing the lists that are done
+    v = NULL;
+    while (sp > 0 && !v) {
+      struct lprint *p = &stack[sp - 1];
+      int type = lval_type(p->v);
+      int count = type == LVAL_FUN ? 2 : type == LVAL_PART ? 1 : p->v->count;
+      if (p->i < count) {
+        if (p->i > 0) {
+          putchar(' ');
+        }
+        if (type == LVAL_FUN) {
+          v = p->i ? p->v->body : p->v->formals;
+        } else if (type == LVAL_PART) {
+          v = p->v->fun->body;
+        } else {
+          v = p->v->cell[p->i];
+        }
+        p->i++;
+      } else {
+        putchar(lval_type(p->v) == LVAL_QEXPR ? '}' : ')');
+        sp--;
+      }
+    }
+    if (!v) {
+      break;
+    }
+  }
+  free(stack);
+}
+
+void lval_println(lval *v) {
+  lval_print(v);
+  putchar('\n');
+}
+
+lval *lval_pop(lval *v, int i) {
+  lval *x = v->cell[i];
+
+  if (i == 0) {
+    v->cell++;
+    v->start++;
+  } else {
+    memmove(&v->cell[i], &v->cell[i + 1],
+            sizeof(lval*) * (v->count - (i + 1)));
+  }
+
+  v->count--;
+  return x;
+}
+
+lval *lval_take(lval *v, int i) {
+  lval *x = lval_pop(v, i);
   lval_del(v);
   return x;
 }
 
+/* Values are shared and copied on write: lval_copy hands out another
+   reference, lval_unshare must be called before mutating a value that
+   may have other owners */
 lval *lval_copy(lval *v) {
-  lval *x = malloc(sizeof(lval));
-  x->type = v->type;
-  
+  if (!LVAL_FIXNUM(v)) {
+    v->ref++;
+  }
+  return v;
+}
+
+/* Shallow copy: children are shared with v */
+lval *lval_dup(lval *v) {
+  if (LVAL_FIXNUM(v)) {
+    return v;
+  }
+  lval *x = lval_alloc(v->type);
+
   switch(v->type) {
   case LVAL_NUM:
     x->num = v->num;
     break;
   case LVAL_SYM:
-    x->sym = malloc(strlen(v->sym) + 1);
-    strcpy(x->sym, v->sym);
+    x->atom = v->atom;
+    x->depth = v->depth;
+    x->slot = v->slot;
+    x->cached = v->cached;
+    x->global = v->global;
     break;
   case LVAL_FUN:
     if (v->builtin) {
       x->builtin = v->builtin;
     } else {
       x->builtin = NULL;
-      x->env = lenv_copy(v->env);
+      x->env = v->env;
       x->formals = lval_copy(v->formals);
       x->body = lval_copy(v->body);
+      x->code = v->code;
+      if (x->code) {
+        x->code->ref++;
+      }
+      x->arity = v->arity;
+      x->variadic = v->variadic;
+      x->calls = v->calls;
     }
     break;
+  case LVAL_PART:
+    x->fun = lval_copy(v->fun);
+    x->args = lval_copy(v->args);
+    break;
   case LVAL_SEXPR:
   case LVAL_QEXPR:
+    lval_list_init(x);
+    lval_reserve(x, v->count);
     x->count = v->count;
-    x->cell = malloc(sizeof(lval *) * x->count);
     for (int i = 0; i < x->count; i++) {
       x->cell[i] = lval_copy(v->cell[i]);
     }
     break;
   case LVAL_ERR:
-    x->err = malloc(sizeof(v->err) + 1);
+    x->err = malloc(strlen(v->err) + 1);
     strcpy(x->err, v->err);
     break;
   }
@@ -309,55 +1229,176 @@ lval *lval_copy(lval *v) {
   return x;
 }
 
+lval *lval_unshare(lval *v) {
+  if (LVAL_FIXNUM(v) || v->ref == 1) {
+    return v;
+  }
+  v->ref--;
+  return lval_dup(v);
+}
+
 lenv *lenv_new(void) {
-  lenv *e = malloc(sizeof(lenv));
+  lenv *e = lslab_alloc(lslab_class_of(sizeof(lenv)));
+  e->mark = lgc_phase == LGC_MARK;
+  e->remembered = 0;
+  e->next = lgc_envs;
+  lgc_envs = e;
+  lgc_bytes += sizeof(lenv);
+
   e->parent = NULL;
   e->count = 0;
   e->syms = NULL;
   e->vals = NULL;
+  e->index = NULL;
+  e->index_size = 0;
   return e;
 }
 
-void lenv_del(lenv *e) {
+void lenv_free(lenv *e) {
+  if (!e->parent) {
+    lglobal_version++;
+  }
+  lmem_free(e->syms, sizeof(int) * e->count);
+  lmem_free(e->vals, sizeof(lval *) * e->count);
+  lmem_free(e->index, sizeof(int) * e->index_size);
+  lslab_free(e);
+}
+
+unsigned int lenv_hash(lenv *e, int atom) {
+  return ((unsigned int)atom * 2654435761u) & (e->index_size - 1);
+}
+
+/* Rebuild the index at least twice as large as e, so probes end */
+void lenv_reindex(lenv *e) {
+  lmem_free(e->index, sizeof(int) * e->index_size);
+  e->index_size = e->index_size ? e->index_size * 2 : LENV_LINEAR_MAX * 4;
+  while (e->index_size <= 2 * e->count) {
+    e->index_size *= 2;
+  }
+  e->index = lmem_alloc(sizeof(int) * e->index_size);
+  for (int i = 0; i < e->index_size; i++) {
+    e->index[i] = -1;
+  }
   for (int i = 0; i < e->count; i++) {
-    free(e->syms[i]);
-    lval_del(e->vals[i]);
+    unsigned int h = lenv_hash(e, e->syms[i]);
+    while (e->index[h] >= 0) {
+      h = (h + 1) & (e->index_size - 1);
+    }
+    e->index[h] = i;
   }
-  free(e->syms);
-  free(e->vals);
-  free(e);
 }
 
-lval *lenv_get(lenv *e, lval *k) {
+/* Slot of atom in e itself, or -1 */
+int lenv_find(lenv *e, int atom) {
+  if (e->index) {
+    unsigned int h = lenv_hash(e, atom);
+    while (e->index[h] >= 0) {
+      if (e->syms[e->index[h]] == atom) {
+        return e->index[h];
+      }
+      h = (h + 1) & (e->index_size - 1);
+    }
+    return -1;
+  }
+
   for (int i = 0; i < e->count; i++) {
-    if (strcmp(e->syms[i], k->sym) == 0) {
-      return lval_copy(e->vals[i]);
+    if (e->syms[i] == atom) {
+      return i;
     }
   }
-  if (e->parent) {
-    return lenv_get(e->parent, k);
-  } else {
-    return lval_err("unbound symbol '%s'", k->sym);
+  return -1;
+}
+
+lval *lenv_get(lenv *e, lval *k) {
+  if (k->cached == lglobal_version) {
+    return lval_copy(*k->global);
+  }
+
+  // lexically addressed reference: index straight into the frame
+  if (k->slot >= 0) {
+    lenv *f = e;
+    for (int d = 0; d < k->depth && f; d++) {
+      f = f->parent;
+    }
+    if (f && k->slot < f->count && f->syms[k->slot] == k->atom) {
+      return lval_copy(f->vals[k->slot]);
+    }
   }
+
+  // the chain is as long as the call depth, so walk it in a loop
+  for (; e; e = e->parent) {
+    int i = lenv_find(e, k->atom);
+    if (i >= 0) {
+      if (!e->parent && !latom_local[k->atom]) {
+        k->cached = lglobal_version;
+        k->global = &e->vals[i];
+      }
+      return lval_copy(e->vals[i]);
+    }
+  }
+  return lval_err("unbound symbol '%s'", latom_name(k->atom));
 }
 
 void lenv_put(lenv *e, lval *k, lval *v) {
-  for (int i = 0; i < e->count; i++) {
-    if (strcmp(e->syms[i], k->sym) == 0) {
-      lval_del(e->vals[i]);
-      e->vals[i] = lval_copy(v);
-      return;
-    }
+  if (e->parent) {
+    latom_bind_local(k->atom);
+  }
+
+  // cached cells see a new value in place, but growing the root env
+  // moves them
+  int i = lenv_find(e, k->atom);
+  if (i >= 0) {
+    lval_del(e->vals[i]);
+    e->vals[i] = lval_copy(v);
+    lgc_write_env(e, v);
+    return;
   }
 
+  if (!e->parent) {
+    lglobal_version++;
+  }
   e->count++;
-  e->syms = realloc(e->syms, sizeof(char *) * e->count);
-  e->vals = realloc(e->vals, sizeof(lval *) * e->count);
+  lgc_bytes += sizeof(int) + sizeof(lval *);
+  e->syms = lmem_resize(e->syms, sizeof(int) * (e->count - 1),
+                        sizeof(int) * e->count);
+  e->vals = lmem_resize(e->vals, sizeof(lval *) * (e->count - 1),
+                        sizeof(lval *) * e->count);
 
-  e->syms[e->count - 1] = malloc(strlen(k->sym) + 1);
-  strcpy(e->syms[e->count - 1], k->sym);
+  e->syms[e->count - 1] = k->atom;
 
   e->vals[e->count - 1] = lval_copy(v);
+  lgc_write_env(e, v);
+
+  if (e->index && e->count * 2 < e->index_size) {
+    unsigned int h = lenv_hash(e, k->atom);
+    while (e->index[h] >= 0) {
+      h = (h + 1) & (e->index_size - 1);
+    }
+    e->index[h] = e->count - 1;
+  } else if (e->count > LENV_LINEAR_MAX) {
+    lenv_reindex(e);
+  }
+}
+
+/* A frame over parent binding the first n formals to args, which it
+   takes over. The arrays are sized once and the args stored straight
+   into their slots. */
+lenv *lenv_frame(lenv *parent, lval *formals, lval **args, int n) {
+  lenv *e = lenv_new();
+  lgc_write_parent(e, parent);
+  e->count = n;
+  e->syms = lmem_alloc(sizeof(int) * n);
+  e->vals = lmem_alloc(sizeof(lval *) * n);
+  lgc_bytes += (sizeof(int) + sizeof(lval *)) * n;
+  for (int i = 0; i < n; i++) {
+    e->syms[i] = formals->cell[i]->atom;
+    e->vals[i] = args[i];
+    lgc_write_env(e, args[i]);
+  }
+  if (n > LENV_LINEAR_MAX) {
+    lenv_reindex(e);
+  }
+  return e;
 }
 
 void lenv_def(lenv *e, lval *k, lval *v) {
@@ -368,98 +1409,759 @@ void lenv_def(lenv *e, lval *k, lval *v) {
   lenv_put(e, k, v);
 }
 
-lenv *lenv_copy(lenv *e) {
-  lenv *n = malloc(sizeof(lenv));
-  n->parent = e->parent;
-  n->count = e->count;
-  n->syms = malloc(sizeof(char *) * n->count);
-  n->vals = malloc(sizeof(lval *) * n->count);
+lval **lgc_gray = NULL;
+int lgc_ngray = 0;
+int lgc_gray_capacity = 0;
+lenv **lgc_gray_envs = NULL;
+int lgc_ngray_envs = 0;
+int lgc_gray_envs_capacity = 0;
 
-  for (int i = 0; i < e->count; i++) {
-    n->syms[i] = malloc(strlen(e->syms[i]) + 1);
-    strcpy(n->syms[i], e->syms[i]);
-    n->vals[i] = lval_copy(e->vals[i]);
+void lgc_shade(lval *v) {
+  // nursery objects are shaded when they are promoted
+  if (LVAL_FIXNUM(v) || !v->old || v->mark) {
+    return;
+  }
+  v->mark = 1;
+  if (lgc_ngray == lgc_gray_capacity) {
+    lgc_gray_capacity = lgc_gray_capacity ? lgc_gray_capacity * 2 : 256;
+    lgc_gray = realloc(lgc_gray, sizeof(lval *) * lgc_gray_capacity);
+  }
+  lgc_gray[lgc_ngray++] = v;
+}
+
+void lgc_shade_env(lenv *e) {
+  if (!e || e->mark) {
+    return;
+  }
+  e->mark = 1;
+  if (lgc_ngray_envs == lgc_gray_envs_capacity) {
+    lgc_gray_envs_capacity =
+      lgc_gray_envs_capacity ? lgc_gray_envs_capacity * 2 : 64;
+    lgc_gray_envs = realloc(lgc_gray_envs,
+                            sizeof(lenv *) * lgc_gray_envs_capacity);
+  }
+  lgc_gray_envs[lgc_ngray_envs++] = e;
+}
+
+void lgc_shade_roots(void) {
+  lgc_shade_env(lgc_global);
+  for (int i = 0; i < lgc_nroots; i++) {
+    lgc_shade(*lgc_roots[i]);
+  }
+  for (int i = 0; i < lvm_sp; i++) {
+    lgc_shade(lvm_stack[i]);
+  }
+  for (int i = 0; i < lstack_sp; i++) {
+    lgc_shade_env(lstack[i].e);
+    if (lstack[i].v) {
+      lgc_shade(lstack[i].v);
+    }
+    if (lstack[i].fun) {
+      lgc_shade(lstack[i].fun);
+    }
+  }
+}
+
+/* Whether a slice that began at start has used up its budget, keeping
+   an eighth in reserve for the work in progress; 0 means no budget */
+int lgc_spent(double start, long budget) {
+  return budget && (ltime_now() - start) * 1e6 >= budget - budget / 8;
+}
+
+/* Large cell arrays are scanned 64 cells at a time, from the top down
+   so that cells shifted down by lval_pop are still seen */
+lval *lgc_partial = NULL;
+int lgc_partial_next = 0;
+
+/* Scan gray objects until none are left (returns 1) or the budget in
+   microseconds runs out */
+int lgc_mark_step(double start, long budget) {
+  long work = 0;
+  while (lgc_partial || lgc_ngray > 0 || lgc_ngray_envs > 0) {
+    if ((lgc_partial || ++work % 64 == 0) && lgc_spent(start, budget)) {
+      return 0;
+    }
+
+    if (lgc_partial) {
+      int i = lgc_partial_next < lgc_partial->count
+        ? lgc_partial_next : lgc_partial->count;
+      int stop = i > 64 ? i - 64 : 0;
+      while (i > stop) {
+        lgc_shade(lgc_partial->cell[--i]);
+      }
+      lgc_partial_next = i;
+      if (i == 0) {
+        lgc_partial = NULL;
+      }
+      continue;
+    }
+
+    if (lgc_ngray_envs > 0) {
+      lenv *e = lgc_gray_envs[--lgc_ngray_envs];
+      for (int i = 0; i < e->count; i++) {
+        lgc_shade(e->vals[i]);
+      }
+      lgc_shade_env(e->parent);
+      continue;
+    }
+
+    lval *v = lgc_gray[--lgc_ngray];
+    switch (v->type) {
+    case LVAL_FUN:
+      if (!(v->builtin)) {
+        lgc_shade_env(v->env);
+        lgc_shade(v->formals);
+        lgc_shade(v->body);
+        if (v->code) {
+          lgc_shade(v->code->consts);
+        }
+      }
+      break;
+    case LVAL_PART:
+      lgc_shade(v->fun);
+      lgc_shade(v->args);
+      break;
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+      lgc_partial = v;
+      lgc_partial_next = v->count;
+      break;
+    }
+  }
+  return 1;
+}
+
+lval **lgc_scan = NULL;
+int lgc_nscan = 0;
+int lgc_scan_capacity = 0;
+
+/* Copy a nursery object into the old space, once */
+lval *lgc_promote(lval *v) {
+  if (LVAL_FIXNUM(v) || v->old) {
+    return v;
+  }
+  if (v->next) {
+    return v->next;
+  }
+
+  size_t size = lval_size(v->type);
+  lval *o = lslab_alloc(lslab_class_of(size));
+  memcpy(o, v, size);
+  if ((o->type == LVAL_SEXPR || o->type == LVAL_QEXPR) && LVAL_IS_SMALL(v)) {
+    o->cell = o->small + o->start;
+  }
+  o->old = 1;
+  o->next = lgc_vals;
+  lgc_vals = o;
+  lgc_bytes += size;
+  lgc_debt += size;
+  if (o->type == LVAL_SEXPR || o->type == LVAL_QEXPR) {
+    lgc_bytes += sizeof(lval *) * o->count;
+    lgc_debt += sizeof(lval *) * o->count;
+  }
+  v->next = o;
+  if (lgc_phase == LGC_MARK) {
+    lgc_shade(o);
+  }
+
+  // children still in the nursery are promoted when o is scanned
+  if (lgc_nscan == lgc_scan_capacity) {
+    lgc_scan_capacity = lgc_scan_capacity ? lgc_scan_capacity * 2 : 256;
+    lgc_scan = realloc(lgc_scan, sizeof(lval *) * lgc_scan_capacity);
+  }
+  lgc_scan[lgc_nscan++] = o;
+  return o;
+}
+
+void lgc_promote_children(lval *v) {
+  switch (v->type) {
+  case LVAL_FUN:
+    if (!(v->builtin)) {
+      v->formals = lgc_promote(v->formals);
+      v->body = lgc_promote(v->body);
+    }
+    break;
+  case LVAL_PART:
+    v->fun = lgc_promote(v->fun);
+    v->args = lgc_promote(v->args);
+    break;
+  case LVAL_SEXPR:
+  case LVAL_QEXPR:
+    for (int i = 0; i < v->count; i++) {
+      v->cell[i] = lgc_promote(v->cell[i]);
+    }
+    break;
+  }
+}
+
+void lgc_minor(void) {
+  double start = ltime_now();
+  long before = lgc_bytes;
+
+  for (int i = 0; i < lgc_nroots; i++) {
+    *lgc_roots[i] = lgc_promote(*lgc_roots[i]);
+  }
+  for (int i = 0; i < lvm_sp; i++) {
+    lvm_stack[i] = lgc_promote(lvm_stack[i]);
+  }
+  for (int i = 0; i < lstack_sp; i++) {
+    if (lstack[i].v) {
+      lstack[i].v = lgc_promote(lstack[i].v);
+    }
+    if (lstack[i].fun) {
+      lstack[i].fun = lgc_promote(lstack[i].fun);
+    }
+  }
+  for (int i = 0; i < lgc_nremembered; i++) {
+    lgc_remembered[i]->remembered = 0;
+    lgc_promote_children(lgc_remembered[i]);
+  }
+  for (int i = 0; i < lgc_nremembered_envs; i++) {
+    lenv *e = lgc_remembered_envs[i];
+    e->remembered = 0;
+    for (int j = 0; j < e->count; j++) {
+      e->vals[j] = lgc_promote(e->vals[j]);
+    }
+  }
+  lgc_nremembered = 0;
+  lgc_nremembered_envs = 0;
+
+  while (lgc_nscan > 0) {
+    lgc_promote_children(lgc_scan[--lgc_nscan]);
+  }
+
+  // dead objects still own their cells and strings
+  long survivors = 0;
+  long objects = 0;
+  for (int c = 0; c <= lgc_chunk; c++) {
+    char *end = c == lgc_chunk ? lgc_top : lgc_tops[c];
+    for (char *p = lgc_chunks[c]; p < end; p += lval_size(((lval *)p)->type)) {
+      lval *v = (lval *)p;
+      objects++;
+      if (v->next) {
+        survivors++;
+      } else {
+        lval_free_fields(v);
+      }
+    }
+  }
+
+  // keep the configured nursery, give back what a burst added
+  while (lgc_nchunks > lgc_nursery_chunks) {
+    free(lgc_chunks[--lgc_nchunks]);
+  }
+  lgc_chunk = -1;
+  lgc_top = lgc_limit = NULL;
+  lgc_nursery_bytes = 0;
+  lgc_minor_collections++;
+  lslab_trim();
+
+  if (lgc_stats) {
+    double elapsed = ltime_now() - start;
+    fprintf(stderr,
+            "gc minor #%d: %ld objects, %ld promoted, "
+            "old heap %ld -> %ld bytes, %.3f ms\n",
+            lgc_minor_collections, objects, survivors, before, lgc_bytes,
+            elapsed * 1000);
+  }
+}
+
+lval *lgc_sweep_vals = NULL;
+lenv *lgc_sweep_envs = NULL;
+
+// progress of the current major collection, for --gc-stats
+long lgc_cycle_before = 0;
+long lgc_cycle_marked = 0;
+long lgc_cycle_live = 0;
+long lgc_cycle_promoted = 0;  // old space allocated while marking
+long lgc_cycle_objects = 0;
+long lgc_cycle_freed = 0;
+int lgc_cycle_slices = 0;
+
+void lgc_begin(void) {
+  lgc_phase = LGC_MARK;
+  lgc_cycle_before = lgc_bytes;
+  lgc_cycle_live = 0;
+  lgc_cycle_objects = 0;
+  lgc_cycle_freed = 0;
+  lgc_cycle_slices = 0;
+  lgc_shade_roots();
+}
+
+/* Finish marking at a safe point: promote the nursery, rescan the roots
+   and hand the old lists over to the sweeper */
+void lgc_remark(void) {
+  lgc_cycle_promoted = lgc_bytes - lgc_cycle_before;
+  lgc_minor();
+  lgc_shade_roots();
+  lgc_mark_step(0, 0);
+
+  lgc_sweep_vals = lgc_vals;
+  lgc_sweep_envs = lgc_envs;
+  lgc_vals = NULL;
+  lgc_envs = NULL;
+  lgc_cycle_marked = lgc_bytes;
+  lgc_phase = LGC_SWEEP;
+}
+
+void lgc_finish(void) {
+  // the old space allocated while sweeping is counted as live
+  lgc_bytes = lgc_cycle_live + (lgc_bytes - lgc_cycle_marked);
+  // what was promoted while marking is kept, dead or not; the next
+  // cycle frees it, so only what was live at the start sets the trigger
+  long live = lgc_cycle_live - lgc_cycle_promoted;
+  if (live < 0) {
+    live = 0;
+  }
+  lgc_next = live * 2 > lgc_threshold ? live * 2 : lgc_threshold;
+  lgc_collections++;
+  lgc_phase = LGC_IDLE;
+  lslab_trim();
+
+  if (lgc_stats) {
+    fprintf(stderr,
+            "gc #%d: %ld objects, %ld freed, heap %ld -> %ld bytes, "
+            "next at %ld, %d slices\n",
+            lgc_collections, lgc_cycle_objects, lgc_cycle_freed,
+            lgc_cycle_before, lgc_bytes, lgc_next, lgc_cycle_slices);
+  }
+}
+
+/* Free unmarked objects and relink the survivors, within the budget
+   like lgc_mark_step */
+int lgc_sweep_step(double start, long budget) {
+  long work = 0;
+  while (lgc_sweep_vals || lgc_sweep_envs) {
+    if (++work % 64 == 0 && lgc_spent(start, budget)) {
+      return 0;
+    }
+    lgc_cycle_objects++;
+
+    if (lgc_sweep_vals) {
+      lval *v = lgc_sweep_vals;
+      lgc_sweep_vals = v->next;
+      if (v->mark) {
+        v->mark = 0;
+        lgc_cycle_live += lval_size(v->type);
+        if (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) {
+          lgc_cycle_live += sizeof(lval *) * v->count;
+        }
+        v->next = lgc_vals;
+        lgc_vals = v;
+      } else {
+        lval_free_fields(v);
+        lslab_free(v);
+        lgc_cycle_freed++;
+      }
+      continue;
+    }
+
+    lenv *e = lgc_sweep_envs;
+    lgc_sweep_envs = e->next;
+    if (e->mark) {
+      e->mark = 0;
+      lgc_cycle_live +=
+        sizeof(lenv) + (sizeof(int) + sizeof(lval *)) * e->count;
+      e->next = lgc_envs;
+      lgc_envs = e;
+    } else {
+      lenv_free(e);
+      lgc_cycle_freed++;
+    }
+  }
+
+  lgc_finish();
+  return 1;
+}
+
+/* One slice of major collection work, taken when the allocator needs a
+   new nursery chunk or at a safe point once LGC_CHUNK bytes more have
+   been allocated or promoted. Objects are not moved, so this need not
+   be a safe point. */
+void lgc_step(void) {
+  lgc_debt = 0;
+  if (lgc_phase == LGC_MARK && lgc_ngray == 0 && lgc_ngray_envs == 0) {
+    return;
+  }
+  double start = ltime_now();
+  if (lgc_phase == LGC_MARK) {
+    lgc_mark_step(start, lgc_budget);
+  } else {
+    lgc_sweep_step(start, lgc_budget);
+  }
+  lgc_cycle_slices++;
+  lgc_pause(start);
+}
+
+/* Run the rest of the current major collection, or a whole one, in a
+   single pause */
+void lgc_collect(void) {
+  if (lgc_phase == LGC_IDLE) {
+    lgc_begin();
+  }
+  if (lgc_phase == LGC_MARK) {
+    lgc_remark();
+  }
+  lgc_cycle_slices++;
+  lgc_sweep_step(0, 0);
+}
+
+/* Safe point: end marking once the gray objects run out, start a major
+   collection when the old space has grown past the trigger, or empty
+   the nursery when it is full, counting the cell arrays of its lists */
+void lgc_poll(void) {
+  double start;
+  if (lgc_phase == LGC_MARK && lgc_ngray == 0 && lgc_ngray_envs == 0) {
+    start = ltime_now();
+    lgc_remark();
+    lgc_cycle_slices++;
+  } else if (lgc_phase == LGC_IDLE && lgc_bytes > lgc_next) {
+    start = ltime_now();
+    if (lgc_budget) {
+      lgc_begin();
+    } else {
+      lgc_collect();
+    }
+  } else if (lgc_phase != LGC_IDLE && lgc_bytes > 2 * lgc_cycle_before) {
+    // the program allocates faster than the slices keep up with
+    start = ltime_now();
+    lgc_collect();
+  } else if (lgc_phase != LGC_IDLE && lgc_debt > LGC_CHUNK) {
+    // keep the slices in step with the cell arrays and promotions too
+    lgc_step();
+    return;
+  } else if (lgc_chunk >= lgc_nursery_chunks
+             || lgc_nursery_bytes > (long)lgc_nursery_chunks * LGC_CHUNK) {
+    start = ltime_now();
+    lgc_minor();
+  } else {
+    return;
+  }
+  lgc_pause(start);
+}
+
+void lgc_report(void) {
+  long p50 = 0;
+  long p99 = 0;
+  long seen = 0;
+  for (int i = 0; i < LGC_HISTOGRAM; i++) {
+    seen += lgc_pauses[i];
+    if (!p50 && seen * 2 >= lgc_npauses) {
+      p50 = 1L << i;
+    }
+    if (!p99 && seen * 100 >= lgc_npauses * 99) {
+      p99 = 1L << i;
+    }
+  }
+  fprintf(stderr, "gc pauses: %ld, p50 < %ld us, p99 < %ld us, "
+          "max %.0f us, %ld over the %ld us budget\n",
+          lgc_npauses, p50, p99, lgc_max_pause, lgc_over_budget, lgc_budget);
+  for (int i = 0; i < LGC_HISTOGRAM; i++) {
+    if (lgc_pauses[i]) {
+      fprintf(stderr, "  < %8ld us: %ld\n", 1L << i, lgc_pauses[i]);
+    }
   }
-  
-  return n;
 }
 
 #define LASSERT(arg, cond, format, ...) \
   if (!(cond)) { \
+    lval *err = lval_err(format, ##__VA_ARGS__); \
     lval_del(arg); \
-    return lval_err(format, ##__VA_ARGS__); \
+    return err; \
   }
 
 #define LASSERT_NUM(func, arg, num) \
   LASSERT(arg, \
     arg->count == num, \
     "Function '%s' passed incorrect number of arguments. " \
-    "Got %i, Expected %i." \
+    "Got %i, Expected %i.", \
     func, arg->count, num)
 
 #define LASSERT_TYPE(func, arg, index, expect_type)        \
   LASSERT(arg, \
-    arg->cell[index]->type == expect_type, \
+    lval_type(arg->cell[index]) == expect_type, \
     "Function '%s' passed incorrect type for arguments. " \
     "Got %s, Expected %s.", \
-    ltype_name(arg->cell[index]->type), ltype_name(expect_type))
+    func, ltype_name(lval_type(arg->cell[index])), ltype_name(expect_type))
 
-lval *lval_call(lenv *e, lval *fun, lval *arg) {
-  if (fun->builtin) {
-    return fun->builtin(e, arg);
+/* How many args a call of fun takes before it runs: its formals up to
+   the first after '&' */
+int lval_needs(lval *fun) {
+  if (fun->arity >= 0) {
+    return fun->arity + fun->variadic;
+  }
+  for (int i = 0; i < fun->formals->count; i++) {
+    if (fun->formals->cell[i]->atom == latom_amp) {
+      return i + 1;
+    }
+  }
+  return fun->formals->count;
+}
+
+/* The function of partial application p, with the args p holds put in
+   front of *arg */
+lval *lval_unpartial(lval *p, lval **arg) {
+  lval *x = lval_sexpr();
+  lval_reserve(x, p->args->count + (*arg)->count);
+  for (int i = 0; i < p->args->count; i++) {
+    x->cell[x->count++] = lval_copy(p->args->cell[i]);
+  }
+  for (int i = 0; i < (*arg)->count; i++) {
+    x->cell[x->count++] = (*arg)->cell[i];
+  }
+  (*arg)->count = 0;
+  lval_del(*arg);
+  *arg = x;
+
+  lval *fun = lval_copy(p->fun);
+  lval_del(p);
+  return fun;
+}
+
+/* Bind arg to the formals of fun in a new frame over its env. Returns
+   fun with the frame in *frame once every formal is bound, otherwise a
+   partial application holding arg, or an error */
+lval *lval_bind(lenv *e, lval *fun, lval *arg, lenv **frame) {
+  lval *formals = fun->formals;
+  *frame = NULL;
+
+  if (arg->count < lval_needs(fun)) {
+    lval *p = lval_alloc(LVAL_PART);
+    p->fun = fun;
+    p->args = arg;
+    return p;
+  }
+
+  // exactly the fixed formals: the args move into their slots
+  if (fun->arity == arg->count && !fun->variadic) {
+    *frame = lenv_frame(fun->env, formals, arg->cell, arg->count);
+    arg->count = 0;
+    lval_del(arg);
+    return fun;
   }
 
+  // the fixed formals, then what is left of arg becomes the rest
+  if (fun->variadic && fun->arity >= 0 && arg->count > fun->arity) {
+    lenv *env = lenv_frame(fun->env, formals, arg->cell, fun->arity);
+    for (int i = 0; i < fun->arity; i++) {
+      lval_pop(arg, 0);
+    }
+    lval *rest = formals->cell[fun->arity + 1];
+    lenv_put(env, rest, builtin_list(e, arg));
+    lval_del(arg);
+    *frame = env;
+    return fun;
+  }
+
+  lenv *env = lenv_new();
+  lgc_write_parent(env, fun->env);
+
   int given_count = arg->count;
-  int total_count = fun->formals->count;
+  int total_count = formals->count;
+  int i = 0;
 
   while (arg->count) {
-    if (fun->formals->count == 0) {
+    if (i == formals->count) {
+      lval_del(fun);
       lval_del(arg);
       return lval_err("Function passed too many arguments. "
                       "Got %i, Expect %i.",
                       given_count, total_count);
     }
 
-    lval *sym = lval_pop(fun->formals, 0);
+    lval *sym = formals->cell[i++];
 
-    if (strcmp(sym->sym, "&") == 0) {
-      if (fun->formals-> count != 1) {
+    if (sym->atom == latom_amp) {
+      if (formals->count - i != 1) {
+        lval_del(fun);
         lval_del(arg);
         return lval_err("Function format invalid."
                         "Symbol '&' not followed by single symbol.");
       }
 
-      lval *next_sym = lval_pop(fun->formals, 0);
-      lenv_put(fun->env, next_sym, builtin_list(e, arg));
-      lval_del(next_sym);
+      lenv_put(env, formals->cell[i++], builtin_list(e, arg));
       break;
     }
     
     lval *val = lval_pop(arg, 0);
-
-    lenv_put(fun->env, sym, val);
-
-    lval_del(sym);
+    lenv_put(env, sym, val);
     lval_del(val);
   }
   
   lval_del(arg);
 
-  if (fun->formals->count == 0) {
-    fun->env->parent = e;
-    return builtin_eval(fun->env,
-                        lval_add_cell(lval_sexpr(), lval_copy(fun->body)));
-  } else {
-    return lval_copy(fun);
-  }
+  *frame = env;
+  return fun;
 }
 
-lval *lval_join(lval *x, lval *y) {
-  while (y->count > 0) {
-    lval_add_cell(x, lval_pop(y, 0));
-  }
-  lval_del(y);
-  return x;
+/* Calls that still recurse in C, those of the closure engine and those
+   entering a function body, check the native stack against
+   lstack_c_limit below the base taken in main */
+char *lstack_c_base = NULL;
+long lstack_c_limit = 7 * 1024 * 1024;
+
+int lstack_c_exhausted(void) {
+  return lstack_c_base - (char *)__builtin_frame_address(0) > lstack_c_limit;
+}
+
+lval *lstack_c_overflow(void) {
+  return lval_err("Evaluation stack exhausted. "
+                  "Native stack limit %li bytes.", lstack_c_limit);
+}
+
+/* Tiered engine: lambdas are interpreted until ltier_threshold calls,
+   then compiled to bytecode and run on the VM from then on */
+enum { LTIER_INTERP, LTIER_VM, LTIER_IDLE };
+
+int ltier_threshold = 100;
+int ltier_stats = 0;
+int ltier_compiled = 0;
+int ljit_enabled = 1;
+long ljit_calls = 0;
+long ljit_bails = 0;
+int ltier_current = LTIER_IDLE;
+double ltier_since = 0;
+double ltier_time[LTIER_IDLE + 1];
+
+/* Charge the time since the last switch to the running tier and make
+   tier the running one. Returns the one it replaced. */
+int ltier_switch(int tier) {
+  double now = ltime_now();
+  ltier_time[ltier_current] += now - ltier_since;
+  ltier_since = now;
+  int prev = ltier_current;
+  ltier_current = tier;
+  return prev;
+}
+
+/* Count a call of lambda fun, compiling it once it turns hot, or at
+   once if tail is set. Numeric ones get native code as well. */
+void ltier_count(lval *fun, int tail) {
+  if (lengine != LENGINE_TIERED || fun->code
+      || (++fun->calls < ltier_threshold && !tail)) {
+    return;
+  }
+  fun->code = lcode_compile(fun->body);
+  fun->code->jit = ljit_compile(fun);
+  ltier_compiled++;
+
+  if (ltier_stats) {
+    char const *name = "lambda";
+    for (int i = 0; i < lgc_global->count; i++) {
+      if (lgc_global->vals[i] == fun) {
+        name = latom_name(lgc_global->syms[i]);
+      }
+    }
+    fprintf(stderr, "tier: %s compiled after %d calls%s, %d ops",
+            name, fun->calls, tail ? " for a tail call from the vm" : "",
+            fun->code->count);
+    if (fun->code->jit) {
+      fprintf(stderr, ", %d bytes native", (int)fun->code->jit->size);
+    }
+    fprintf(stderr, "\n");
+  }
+}
+
+void ltier_report(void) {
+  fprintf(stderr, "tier: %d functions compiled, "
+          "interpreter %.1f ms, vm %.1f ms, "
+          "%ld native calls, %ld bailed out\n", ltier_compiled,
+          ltier_time[LTIER_INTERP] * 1e3, ltier_time[LTIER_VM] * 1e3,
+          ljit_calls, ljit_bails);
+}
+
+/* Run the body of fun in its bound frame */
+lval *lval_enter(lenv *frame, lval *fun) {
+  if (lstack_c_exhausted()) {
+    lval_del(fun);
+    return lstack_c_overflow();
+  }
+  if (fun->code && fun->code->jit && frame->count == fun->arity) {
+    lval *x = ljit_run(fun, frame->vals, frame);
+    if (x) {
+      lval_del(fun);
+      return x;
+    }
+  }
+  int tier = ltier_stats
+    ? ltier_switch(fun->code ? LTIER_VM : LTIER_INTERP) : LTIER_IDLE;
+  lgc_push(&fun);
+  lval *x;
+  if (!fun->code) {
+    x = builtin_eval(frame,
+                     lval_add_cell(lval_sexpr(), lval_copy(fun->body)));
+  } else if (lengine == LENGINE_CLOSURE) {
+    x = lnode_run(frame, fun->code);
+  } else {
+    x = lvm_run(frame, fun->code);
+  }
+  lgc_pop(1);
+  lval_del(fun);
+  if (ltier_stats) {
+    ltier_switch(tier);
+  }
+  return x;
+}
+
+lval *lval_call(lenv *e, lval *fun, lval *arg) {
+  if (lval_type(fun) == LVAL_PART) {
+    fun = lval_unpartial(fun, &arg);
+  }
+  if (fun->builtin) {
+    lgc_push(&fun);
+    lval *x = fun->builtin(e, arg);
+    lgc_pop(1);
+    lval_del(fun);
+    return x;
+  }
+
+  lenv *frame;
+  fun = lval_bind(e, fun, arg, &frame);
+  if (!frame) {
+    return fun;
+  }
+  ltier_count(fun, 0);
+  return lval_enter(frame, fun);
+}
+
+/* Fold op over the numbers in cells, which stay with the caller */
+lval *lval_arith(char op, lval **cells, int count) {
+  // Ensure all arguments are numbers
+  for (int i = 0; i < count; i++) {
+    if (lval_type(cells[i]) != LVAL_NUM) {
+      return lval_err("Cannot operate on non-number");
+    }
+  }
+
+  long x = lval_get_num(cells[0]);
+  if (op == '-' && count == 1) {
+    x = - x;
+  }
+
+  for (int i = 1; i < count; i++) {
+    long n = lval_get_num(cells[i]);
+    switch (op) {
+    case '+': x += n; break;
+    case '-': x -= n; break;
+    case '*': x *= n; break;
+    case '/':
+      if (n == 0) {
+        return lval_err("Division by zero");
+      }
+      x /= n;
+      break;
+    }
+  }
+  return lval_num(x);
+}
+
+lval *lval_join(lval *x, lval *y) {
+  lval_reserve(x, x->count + y->count);
+  for (int i = 0; i < y->count; i++) {
+    lval_add_cell(x, lval_copy(y->cell[i]));
+  }
+  lval_del(y);
+  return x;
 }
 
 void lenv_add_builtin(lenv *e, char const *name, lbuiltin fun) {
@@ -470,50 +2172,1406 @@ void lenv_add_builtin(lenv *e, char const *name, lbuiltin fun) {
   lval_del(v);
 }
 
-lval *lval_eval_sexpr(lenv *e, lval *v) {
-  for (int i = 0; i < v->count; i++) {
-    v->cell[i] = lval_eval(e, v->cell[i]);
-    if (v->cell[i]->type == LVAL_ERR) {
-      return lval_take(v, i);
-    }
+/* Push a frame evaluating in e, or return NULL once the stack would
+   outgrow its limit */
+lframe *lstack_push(lenv *e, lval *v) {
+  if (lstack_sp == lstack_capacity) {
+    int max = lstack_limit / sizeof(lframe);
+    if (lstack_sp >= max) {
+      return NULL;
+    }
+    lstack_capacity = lstack_capacity ? lstack_capacity * 2 : 64;
+    if (lstack_capacity > max) {
+      lstack_capacity = max;
+    }
+    lstack = realloc(lstack, sizeof(lframe) * lstack_capacity);
+  }
+
+  lframe *f = &lstack[lstack_sp++];
+  f->e = e;
+  f->fun = NULL;
+  f->v = v;
+  f->i = 0;
+  f->base = lvm_sp;
+  f->code = NULL;
+  f->own = NULL;
+  return f;
+}
+
+void lstack_pop(void) {
+  lframe *f = &lstack[--lstack_sp];
+  if (f->fun) {
+    lval_del(f->fun);
+  }
+  if (f->own) {
+    lcode_del(f->own);
+  }
+}
+
+lval *lstack_overflow(void) {
+  return lval_err("Evaluation stack exhausted. Limit %li bytes.",
+                  lstack_limit);
+}
+
+/* Apply the evaluated cells of f. Returns the value of the frame, or
+   NULL when a call in tail position, to a lambda or to eval, has
+   replaced its expression to keep going in the same frame */
+lval *lval_apply(lframe *f) {
+  lval *v = f->v;
+  f->v = NULL;
+
+  // empty expression
+  if (v->count == 0) {
+    return v;
+  }
+
+  // single expression
+  if (v->count == 1) {
+    return lval_take(v, 0);
+  }
+
+  lval *fun = lval_pop(v, 0);
+  if (lval_type(fun) == LVAL_PART) {
+    fun = lval_unpartial(fun, &v);
+  }
+  if (lval_type(fun) != LVAL_FUN) {
+    lval *err = lval_err("S-Expression starts with incorrect type. "
+                         "Got %s, Expected %s.",
+                         ltype_name(lval_type(fun)), ltype_name(LVAL_FUN));
+    lval_del(fun);
+    lval_del(v);
+    return err;
+  }
+
+  // eval of a single Q-Expression continues with it in this env
+  if (fun->builtin == builtin_eval
+      && v->count == 1 && lval_type(v->cell[0]) == LVAL_QEXPR) {
+    lval_del(fun);
+    f->v = lval_unshare(lval_take(v, 0));
+    f->v->type = LVAL_SEXPR;
+    f->i = 0;
+    return NULL;
+  }
+
+  if (fun->builtin) {
+    return lval_call(f->e, fun, v);
+  }
+
+  lenv *frame;
+  fun = lval_bind(f->e, fun, v, &frame);
+  if (!frame) {
+    return fun;
+  }
+  ltier_count(fun, 0);
+  if (fun->code) {
+    return lval_enter(frame, fun);
+  }
+
+  // continue with the body in the new frame, dropping the old one
+  if (f->fun) {
+    lval_del(f->fun);
+  }
+  f->fun = fun;
+  f->e = frame;
+  f->v = lval_unshare(lval_copy(fun->body));
+  f->v->type = LVAL_SEXPR;
+  f->i = 0;
+  return NULL;
+}
+
+/* Evaluates on lstack rather than by recursion: each S-Expression
+   being evaluated has a frame, and cells replace by their values in
+   place until the frame is applied */
+lval *lval_eval(lenv *e, lval *v) {
+  if (lval_type(v) == LVAL_SYM) {
+    lval *x = lenv_get(e, v);
+    lval_del(v);
+    return x;
+  }
+  if (lval_type(v) != LVAL_SEXPR) {
+    return v;
+  }
+
+  int base = lstack_sp;
+  v = lval_unshare(v);
+  if (!lstack_push(e, v)) {
+    lval_del(v);
+    return lstack_overflow();
+  }
+  lgc_poll();
+
+  while (1) {
+    lframe *f = &lstack[lstack_sp - 1];
+    lval *x;
+
+    if (f->i < f->v->count) {
+      x = f->v->cell[f->i];
+      if (lval_type(x) == LVAL_SEXPR) {
+        x = lval_unshare(x);
+        if (lstack_push(f->e, x)) {
+          lgc_poll();
+          continue;
+        }
+        lval_del(x);
+        x = lstack_overflow();
+      } else if (lval_type(x) == LVAL_SYM) {
+        lval *k = x;
+        x = lenv_get(f->e, k);
+        lval_del(k);
+      }
+    } else {
+      x = lval_apply(f);
+      if (!x) {
+        lgc_poll();
+        continue;
+      }
+      lstack_pop();
+      if (lstack_sp == base) {
+        return x;
+      }
+      f = &lstack[lstack_sp - 1];
+    }
+
+    // x is the value of the next cell of f, an error ends f too
+    while (1) {
+      f->v->cell[f->i] = x;
+      lgc_write(f->v, x);
+      if (lval_type(x) != LVAL_ERR) {
+        f->i++;
+        break;
+      }
+      x = lval_take(f->v, f->i);
+      lstack_pop();
+      if (lstack_sp == base) {
+        return x;
+      }
+      f = &lstack[lstack_sp - 1];
+    }
+  }
+}
+
+lcode *lcode_new(void) {
+  lcode *c = malloc(sizeof(lcode));
+  c->ref = 1;
+  c->count = 0;
+  c->capacity = 0;
+  c->ops = NULL;
+  c->depth = 0;
+  c->max_depth = 0;
+  c->node = NULL;
+  c->jit = NULL;
+  // consts hangs off a plain struct the barrier cannot see, keep it old
+  c->consts = lval_alloc_old(LVAL_QEXPR);
+  lval_list_init(c->consts);
+  return c;
+}
+
+void lcode_del(lcode *c) {
+  if (--c->ref > 0) {
+    return;
+  }
+  free(c->ops);
+  if (c->node) {
+    lnode_free(c->node);
+  }
+  if (c->jit) {
+    ljit_free(c->jit);
+  }
+  free(c);
+}
+
+void lcode_emit(lcode *c, int op, int arg) {
+  if (c->count == c->capacity) {
+    c->capacity = c->capacity ? c->capacity * 2 : 8;
+    c->ops = realloc(c->ops, sizeof(unsigned int) * c->capacity);
+  }
+  c->ops[c->count++] = OP_MAKE(op, arg);
+
+  // track the value stack depth the VM has to reserve
+  switch (op) {
+  case OP_CONST:
+  case OP_LOAD:
+  case OP_NIL:
+    c->depth++;
+    break;
+  case OP_CALL:
+  case OP_TAIL:
+    c->depth -= arg - 1;
+    break;
+  case OP_RETURN:
+    c->depth--;
+    break;
+  }
+  if (c->depth > c->max_depth) {
+    c->max_depth = c->depth;
+  }
+}
+
+int lcode_const(lcode *c, lval *v) {
+  lval_add_cell(c->consts, lval_copy(v));
+  return c->consts->count - 1;
+}
+
+/* Calls of pure builtins on known values are compiled to their value
+   as well as to the call. The value is used while the names called
+   still resolve to the same builtins where the code runs: the global
+   cells cached in the symbols make that a version check. */
+
+/* Calls that fold in the expression being compiled, outermost only and
+   in the order the compilers reach them: the call, its value and its
+   guards. Worked out once by lfold_walk before compiling. */
+lval *lfold_calls = NULL;
+int lfold_next = 0;
+
+/* Add name k, bound to builtin fun, to guards unless it is there: the
+   names of one body are all looked up in the same env */
+void lfold_guard(lval *guards, lval *k, lval *fun) {
+  for (int i = 0; i < guards->count; i += 2) {
+    if (guards->cell[i]->atom == k->atom) {
+      return;
+    }
+  }
+  lval_add_cell(guards, lval_copy(k));
+  lval_add_cell(guards, lval_copy(fun));
+}
+
+lval *lfold_call(lval *v, lval *guards);
+
+/* The value of v if it is a number, a quoted list or a call of a pure
+   builtin on such values, adding the names called to guards. NULL
+   otherwise. */
+lval *lfold_walk(lval *v, lval *guards) {
+  switch (lval_type(v)) {
+  case LVAL_NUM:
+  case LVAL_QEXPR:
+    return lval_copy(v);
+  case LVAL_SEXPR:
+    return lfold_call(v, guards);
+  default:
+    return NULL;
+  }
+}
+
+/* Like lfold_walk for v evaluated as an S-Expression. Each call is
+   visited once: one that folds replaces the calls inside it in
+   lfold_calls, and a call that fails is left to fail when it runs. */
+lval *lfold_call(lval *v, lval *guards) {
+  if (v->count == 0) {
+    return NULL;
+  }
+  // single expression evaluates to its only cell
+  if (v->count == 1) {
+    return lfold_walk(v->cell[0], guards);
+  }
+
+  int mark = lfold_calls->count;
+  lval *own = lval_qexpr();
+  lval *arg = lval_sexpr();
+  int known = 1;
+  for (int j = 0; j < v->count; j++) {
+    // a call of a call is not folded, but the inner one may be
+    if (j == 0) {
+      if (lval_type(v->cell[0]) == LVAL_SEXPR) {
+        lval *x = lfold_call(v->cell[0], own);
+        if (x) {
+          lval_del(x);
+        }
+      }
+      continue;
+    }
+    lval *x = lfold_walk(v->cell[j], own);
+    if (x && known) {
+      lval_add_cell(arg, x);
+    } else {
+      known = 0;
+      if (x) {
+        lval_del(x);
+      }
+    }
+  }
+
+  lval *f = v->cell[0];
+  int i = lval_type(f) == LVAL_SYM && f->slot < 0 && lgc_global
+    ? lenv_find(lgc_global, f->atom) : -1;
+  lval *fun = i >= 0 ? lgc_global->vals[i] : NULL;
+  lbuiltin b = fun && lval_type(fun) == LVAL_FUN ? fun->builtin : NULL;
+  if (b != builtin_add && b != builtin_sub && b != builtin_mul
+      && b != builtin_div && b != builtin_list && b != builtin_head
+      && b != builtin_tail && b != builtin_join) {
+    known = 0;
+  }
+  lval *x = known ? b(lgc_global, arg) : NULL;
+  if (!known) {
+    lval_del(arg);
+  }
+  if (!x || lval_type(x) == LVAL_ERR) {
+    if (x) {
+      lval_del(x);
+    }
+    lval_del(own);
+    return NULL;
+  }
+
+  lfold_guard(own, f, fun);
+  while (lfold_calls->count > mark) {
+    lval_del(lval_pop(lfold_calls, lfold_calls->count - 1));
+  }
+  lval_add_cell(lfold_calls, lval_copy(v));
+  lval_add_cell(lfold_calls, lval_copy(x));
+  lval_add_cell(lfold_calls, lval_copy(own));
+  for (int j = 0; j < own->count; j += 2) {
+    lfold_guard(guards, own->cell[j], own->cell[j + 1]);
+  }
+  lval_del(own);
+  return x;
+}
+
+/* Whether the names in guards still resolve to their builtins in e */
+int lfold_valid(lenv *e, lval *guards) {
+  for (int i = 0; i < guards->count; i += 2) {
+    lval *k = guards->cell[i];
+    lbuiltin builtin = guards->cell[i + 1]->builtin;
+    if (k->cached == lglobal_version) {
+      if (lval_type(*k->global) != LVAL_FUN
+          || (*k->global)->builtin != builtin) {
+        return 0;
+      }
+      continue;
+    }
+    lval *f = lenv_get(e, k);
+    int ok = lval_type(f) == LVAL_FUN && f->builtin == builtin;
+    lval_del(f);
+    if (!ok) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* Work out the calls of v that fold, before compiling it */
+void lfold_begin(lval *v) {
+  lfold_calls = lval_qexpr();
+  lfold_next = 0;
+  lval *guards = lval_qexpr();
+  lval *x = lfold_call(v, guards);
+  if (x) {
+    lval_del(x);
+  }
+  lval_del(guards);
+}
+
+void lfold_end(void) {
+  lval_del(lfold_calls);
+  lfold_calls = NULL;
+}
+
+/* Consts index of the value of call v followed by its guards, if
+   lfold_walk found it folds, or -1 */
+int lfold_compile(lcode *c, lval *v) {
+  if (lfold_next == lfold_calls->count
+      || lfold_calls->cell[lfold_next] != v) {
+    return -1;
+  }
+  int i = lcode_const(c, lfold_calls->cell[lfold_next + 1]);
+  lcode_const(c, lfold_calls->cell[lfold_next + 2]);
+  lfold_next += 3;
+  return i;
+}
+
+void lcode_compile_sexpr(lcode *c, lval *v);
+
+void lcode_compile_expr(lcode *c, lval *v) {
+  switch (lval_type(v)) {
+  case LVAL_SYM:
+    lcode_emit(c, OP_LOAD, lcode_const(c, v));
+    break;
+  case LVAL_SEXPR:
+    lcode_compile_sexpr(c, v);
+    break;
+  default:
+    lcode_emit(c, OP_CONST, lcode_const(c, v));
+    break;
+  }
+}
+
+void lcode_compile_sexpr(lcode *c, lval *v) {
+  // empty expression
+  if (v->count == 0) {
+    lcode_emit(c, OP_NIL, 0);
+    return;
+  }
+
+  // the folded value, then the call, with where it ends in the third
+  // const
+  int fold = lfold_compile(c, v);
+  if (fold >= 0) {
+    lval_add_cell(c->consts, lval_num(0));
+    lcode_emit(c, OP_FOLD, fold);
+  }
+
+  for (int i = 0; i < v->count; i++) {
+    lcode_compile_expr(c, v->cell[i]);
+  }
+
+  // single expression evaluates to its only cell
+  if (v->count > 1) {
+    lcode_emit(c, OP_CALL, v->count);
+  }
+  if (fold >= 0) {
+    lval_del(c->consts->cell[fold + 2]);
+    c->consts->cell[fold + 2] = lval_num(c->count);
+    lgc_write(c->consts, c->consts->cell[fold + 2]);
+  }
+}
+
+/* Compile v, evaluated as an S-Expression whatever its type */
+lcode *lcode_compile(lval *v) {
+  lcode *c = lcode_new();
+  lfold_begin(v);
+  if (lengine == LENGINE_CLOSURE) {
+    c->node = lnode_compile_sexpr(c, v, 1);
+    lfold_end();
+    return c;
+  }
+  lcode_compile_sexpr(c, v);
+  lfold_end();
+
+  // the outermost call is in tail position
+  if (c->count && OP_CODE(c->ops[c->count - 1]) == OP_CALL) {
+    c->ops[c->count - 1] = OP_MAKE(OP_TAIL, OP_ARG(c->ops[c->count - 1]));
+  }
+  lcode_emit(c, OP_RETURN, 0);
+  return c;
+}
+
+void lvm_reserve(int depth) {
+  if (lvm_sp + depth > lvm_capacity) {
+    lvm_capacity = (lvm_sp + depth) * 2;
+    lvm_stack = realloc(lvm_stack, sizeof(lval *) * lvm_capacity);
+  }
+}
+
+/* Calls to lambdas and to eval push a frame on lstack instead of
+   recursing, and OP_TAIL reuses the running frame for the callee, so
+   tail-recursive loops run in constant space */
+lval *lvm_run(lenv *e, lcode *c) {
+  int base = lstack_sp;
+  lframe *f = lstack_push(e, c->consts);
+  if (!f) {
+    return lstack_overflow();
+  }
+  f->code = c;
+  lvm_reserve(c->max_depth);
+
+  unsigned int *ip = c->ops;
+  lval **consts = c->consts->cell;
+
+  while (1) {
+    unsigned int i = *ip++;
+    lval *x = NULL;
+
+    switch (OP_CODE(i)) {
+    case OP_CONST:
+      x = lval_copy(consts[OP_ARG(i)]);
+      break;
+    case OP_LOAD:
+      x = lenv_get(e, consts[OP_ARG(i)]);
+      break;
+    case OP_NIL:
+      x = lval_sexpr();
+      break;
+    case OP_FOLD:
+      if (!lfold_valid(e, consts[OP_ARG(i) + 1])) {
+        continue;
+      }
+      x = lval_copy(consts[OP_ARG(i)]);
+      ip = c->ops + lval_get_num(consts[OP_ARG(i) + 2]);
+      break;
+    case OP_CALL:
+    case OP_TAIL: {
+      int n = OP_ARG(i);
+      lgc_poll();
+      lvm_sp -= n;
+      lval *fun = lvm_stack[lvm_sp];
+      int type = lval_type(fun);
+      if (type != LVAL_FUN && type != LVAL_PART) {
+        x = lval_err("S-Expression starts with incorrect type. "
+                     "Got %s, Expected %s.",
+                     ltype_name(lval_type(fun)), ltype_name(LVAL_FUN));
+        for (int j = 0; j < n; j++) {
+          lval_del(lvm_stack[lvm_sp + j]);
+        }
+        break;
+      }
+      lcode *next = NULL;
+      lenv *frame = e;
+      if (type == LVAL_FUN && !fun->builtin
+          && fun->arity == n - 1 && !fun->variadic) {
+        if (fun->code && fun->code->jit
+            && (x = ljit_run(fun, &lvm_stack[lvm_sp + 1], NULL))) {
+          for (int j = 0; j < n; j++) {
+            lval_del(lvm_stack[lvm_sp + j]);
+          }
+          break;
+        }
+        // exactly the fixed formals: the args go from the stack into
+        // their slots
+        frame = lenv_frame(fun->env, fun->formals,
+                           &lvm_stack[lvm_sp + 1], n - 1);
+      } else {
+        lval *arg = lval_sexpr();
+        lval_reserve(arg, n - 1);
+        arg->count = n - 1;
+        memcpy(arg->cell, &lvm_stack[lvm_sp + 1],
+               sizeof(lval *) * arg->count);
+        if (type == LVAL_PART) {
+          fun = lval_unpartial(fun, &arg);
+        }
+
+        // eval of a single Q-Expression runs it in this env
+        if (fun->builtin == builtin_eval
+            && arg->count == 1 && lval_type(arg->cell[0]) == LVAL_QEXPR) {
+          next = lcode_compile(arg->cell[0]);
+          lval_del(fun);
+          lval_del(arg);
+        } else if (fun->builtin) {
+          x = lval_call(e, fun, arg);
+          break;
+        } else {
+          fun = lval_bind(e, fun, arg, &frame);
+          if (!frame) {
+            x = fun;
+            break;
+          }
+        }
+      }
+
+      // a lambda still interpreted runs in the tree evaluator, but one
+      // called in tail position is compiled now to keep looping here
+      if (!next) {
+        ltier_count(fun, OP_CODE(i) == OP_TAIL);
+        if (!fun->code) {
+          x = lval_enter(frame, fun);
+          break;
+        }
+      }
+
+      if (OP_CODE(i) == OP_CALL) {
+        lstack[lstack_sp - 1].i = ip - c->ops;
+        f = lstack_push(frame, NULL);
+        if (!f) {
+          x = lstack_overflow();
+          if (next) {
+            lcode_del(next);
+          } else {
+            lval_del(fun);
+          }
+          break;
+        }
+      } else {
+        // continue in this frame, dropping what the old code held
+        f = &lstack[lstack_sp - 1];
+        if (f->own) {
+          lcode_del(f->own);
+          f->own = NULL;
+        }
+        if (!next && f->fun) {
+          lval_del(f->fun);
+          f->fun = NULL;
+        }
+        f->e = frame;
+      }
+
+      if (next) {
+        f->own = next;
+      } else {
+        f->fun = fun;
+        next = fun->code;
+      }
+      f->code = next;
+      f->v = next->consts;
+      e = f->e;
+      c = next;
+      lvm_reserve(c->max_depth);
+      ip = c->ops;
+      consts = c->consts->cell;
+      continue;
+    }
+    case OP_RETURN:
+      x = lvm_stack[--lvm_sp];
+      lstack_pop();
+      if (lstack_sp == base) {
+        return x;
+      }
+      f = &lstack[lstack_sp - 1];
+      e = f->e;
+      c = f->code;
+      ip = c->ops + f->i;
+      consts = c->consts->cell;
+      break;
+    }
+
+    // an error anywhere ends the whole evaluation
+    if (lval_type(x) == LVAL_ERR) {
+      while (lvm_sp > lstack[base].base) {
+        lval_del(lvm_stack[--lvm_sp]);
+      }
+      while (lstack_sp > base) {
+        lstack_pop();
+      }
+      return x;
+    }
+    lvm_stack[lvm_sp++] = x;
+  }
+}
+
+/* Returned by a call in tail position of the code, which has already
+   set up the running frame to continue with the callee */
+lval lnode_tail_call;
+
+lnode *lnode_new(lnode_fn run, int arg, int count) {
+  lnode *n = malloc(sizeof(lnode));
+  n->run = run;
+  n->arg = arg;
+  n->tail = 0;
+  n->builtin = NULL;
+  n->count = count;
+  n->cells = count ? malloc(sizeof(lnode *) * count) : NULL;
+  return n;
+}
+
+void lnode_free(lnode *n) {
+  for (int i = 0; i < n->count; i++) {
+    lnode_free(n->cells[i]);
+  }
+  free(n->cells);
+  free(n);
+}
+
+lval *lnode_const(lnode *n, lenv *e, lval **consts) {
+  return lval_copy(consts[n->arg]);
+}
+
+lval *lnode_nil(lnode *n, lenv *e, lval **consts) {
+  return lval_sexpr();
+}
+
+lval *lnode_load(lnode *n, lenv *e, lval **consts) {
+  return lenv_get(e, consts[n->arg]);
+}
+
+/* A formal of the running function, in its slot of the frame */
+lval *lnode_local(lnode *n, lenv *e, lval **consts) {
+  lval *k = consts[n->arg];
+  if (k->slot < e->count && e->syms[k->slot] == k->atom) {
+    return lval_copy(e->vals[k->slot]);
+  }
+  return lenv_get(e, k);
+}
+
+/* Push the values of the cells of n on lvm_stack. Returns the first
+   error, with the values pushed so far dropped, or NULL */
+lval *lnode_push(lnode *n, lenv *e, lval **consts) {
+  int base = lvm_sp;
+  lvm_reserve(n->count);
+  for (int i = 0; i < n->count; i++) {
+    lval *x = n->cells[i]->run(n->cells[i], e, consts);
+    if (lval_type(x) == LVAL_ERR) {
+      while (lvm_sp > base) {
+        lval_del(lvm_stack[--lvm_sp]);
+      }
+      return x;
+    }
+    lvm_stack[lvm_sp++] = x;
+  }
+  return NULL;
+}
+
+/* Call the function at base of lvm_stack with the values above it */
+lval *lnode_apply(lenv *e, int base, int tail) {
+  lgc_poll();
+  int n = lvm_sp - base;
+  lval *fun = lvm_stack[base];
+  int type = lval_type(fun);
+  if (type != LVAL_FUN && type != LVAL_PART) {
+    lval *err = lval_err("S-Expression starts with incorrect type. "
+                         "Got %s, Expected %s.",
+                         ltype_name(type), ltype_name(LVAL_FUN));
+    while (lvm_sp > base) {
+      lval_del(lvm_stack[--lvm_sp]);
+    }
+    return err;
+  }
+
+  lcode *next = NULL;
+  lenv *frame = e;
+  if (type == LVAL_FUN && !fun->builtin
+      && fun->arity == n - 1 && !fun->variadic) {
+    frame = lenv_frame(fun->env, fun->formals, &lvm_stack[base + 1], n - 1);
+    lvm_sp = base;
+  } else {
+    lval *arg = lval_sexpr();
+    lval_reserve(arg, n - 1);
+    arg->count = n - 1;
+    memcpy(arg->cell, &lvm_stack[base + 1], sizeof(lval *) * arg->count);
+    lvm_sp = base;
+    if (type == LVAL_PART) {
+      fun = lval_unpartial(fun, &arg);
+    }
+
+    // eval of a single Q-Expression runs it in this env
+    if (fun->builtin == builtin_eval
+        && arg->count == 1 && lval_type(arg->cell[0]) == LVAL_QEXPR) {
+      next = lcode_compile(arg->cell[0]);
+      lval_del(fun);
+      lval_del(arg);
+    } else if (fun->builtin) {
+      return lval_call(e, fun, arg);
+    } else {
+      fun = lval_bind(e, fun, arg, &frame);
+      if (!frame) {
+        return fun;
+      }
+    }
+  }
+
+  if (!tail) {
+    if (!next) {
+      return lval_enter(frame, fun);
+    }
+    lval *x = lnode_run(frame, next);
+    lcode_del(next);
+    return x;
+  }
+
+  // continue in the running frame, dropping what the old code held
+  lframe *f = &lstack[lstack_sp - 1];
+  if (f->own) {
+    lcode_del(f->own);
+    f->own = NULL;
+  }
+  if (!next && f->fun) {
+    lval_del(f->fun);
+    f->fun = NULL;
+  }
+  f->e = frame;
+  if (next) {
+    f->own = next;
+  } else {
+    f->fun = fun;
+    next = fun->code;
+  }
+  f->code = next;
+  f->v = next->consts;
+  return &lnode_tail_call;
+}
+
+lval *lnode_call(lnode *n, lenv *e, lval **consts) {
+  int base = lvm_sp;
+  lval *err = lnode_push(n, e, consts);
+  if (err) {
+    return err;
+  }
+  return lnode_apply(e, base, n->tail);
+}
+
+/* A call whose function is named + - * or /: while the name still
+   means the builtin, the numbers are folded straight off the stack */
+lval *lnode_arith(lnode *n, lenv *e, lval **consts) {
+  int base = lvm_sp;
+  lval *err = lnode_push(n, e, consts);
+  if (err) {
+    return err;
+  }
+  lval *fun = lvm_stack[base];
+  if (lval_type(fun) != LVAL_FUN || fun->builtin != n->builtin) {
+    return lnode_apply(e, base, n->tail);
+  }
+
+  lval *x = lval_arith(n->arg, &lvm_stack[base + 1], n->count - 1);
+  while (lvm_sp > base) {
+    lval_del(lvm_stack[--lvm_sp]);
+  }
+  return x;
+}
+
+/* A folded call: its value while lfold_valid, else the call itself */
+lval *lnode_fold(lnode *n, lenv *e, lval **consts) {
+  if (lfold_valid(e, consts[n->arg + 1])) {
+    return lval_copy(consts[n->arg]);
+  }
+  return n->cells[0]->run(n->cells[0], e, consts);
+}
+
+lnode *lnode_compile_call(lcode *c, lval *v, int tail);
+
+lnode *lnode_compile(lcode *c, lval *v, int tail) {
+  switch (lval_type(v)) {
+  case LVAL_SYM:
+    return lnode_new(v->slot >= 0 && v->depth == 0 ? lnode_local : lnode_load,
+                     lcode_const(c, v), 0);
+  case LVAL_SEXPR:
+    return lnode_compile_sexpr(c, v, tail);
+  default:
+    return lnode_new(lnode_const, lcode_const(c, v), 0);
+  }
+}
+
+/* Compile v as an S-Expression whatever its type */
+lnode *lnode_compile_sexpr(lcode *c, lval *v, int tail) {
+  // empty expression
+  if (v->count == 0) {
+    return lnode_new(lnode_nil, 0, 0);
+  }
+
+  // single expression evaluates to its only cell
+  if (v->count == 1) {
+    return lnode_compile(c, v->cell[0], tail);
+  }
+
+  int fold = lfold_compile(c, v);
+  if (fold >= 0) {
+    lnode *n = lnode_new(lnode_fold, fold, 1);
+    n->cells[0] = lnode_compile_call(c, v, tail);
+    return n;
+  }
+  return lnode_compile_call(c, v, tail);
+}
+
+/* Compile call v, of at least two cells */
+lnode *lnode_compile_call(lcode *c, lval *v, int tail) {
+  lnode *n = lnode_new(lnode_call, 0, v->count);
+  n->tail = tail;
+  for (int i = 0; i < v->count; i++) {
+    n->cells[i] = lnode_compile(c, v->cell[i], 0);
+  }
+
+  lval *f = v->cell[0];
+  char const *name = lval_type(f) == LVAL_SYM ? latom_name(f->atom) : "";
+  if (name[0] && !name[1] && f->slot < 0) {
+    switch (name[0]) {
+    case '+': n->builtin = builtin_add; break;
+    case '-': n->builtin = builtin_sub; break;
+    case '*': n->builtin = builtin_mul; break;
+    case '/': n->builtin = builtin_div; break;
+    }
+  }
+  if (n->builtin) {
+    n->run = lnode_arith;
+    n->arg = name[0];
+  }
+  return n;
+}
+
+/* Run code c in a frame over e, where calls in tail position continue
+   instead of recursing */
+lval *lnode_run(lenv *e, lcode *c) {
+  if (lstack_c_exhausted()) {
+    return lstack_c_overflow();
+  }
+  if (!lstack_push(e, c->consts)) {
+    return lstack_overflow();
+  }
+  lstack[lstack_sp - 1].code = c;
+
+  lval *x;
+  do {
+    lframe *f = &lstack[lstack_sp - 1];
+    x = f->code->node->run(f->code->node, f->e, f->code->consts->cell);
+  } while (x == &lnode_tail_call);
+  lstack_pop();
+  return x;
+}
+
+/* Template JIT for x86-64: the tiered engine turns hot lambdas whose
+   body is only numbers, formals, + - * / and calls of the lambda itself
+   with all its args into native code. Values are untagged longs; formal
+   i of a call is at [rbx + 8 * (arity - 1 - i)], pushed in order by the
+   caller. Self calls in tail position loop, others recurse on the C
+   stack. Overflow, division by zero and running short of native stack
+   bail out to the C caller, which interprets the call instead: the code
+   has no side effects, so running it again gives the same value. */
+
+enum { LJIT_OK, LJIT_BAIL, LJIT_DEEP };
+
+typedef struct {
+  unsigned char *ops;
+  int count;
+  int capacity;
+  int bail;   // offsets of the stub's exits and of the body
+  int deep;
+  int body;
+  int loop;
+} ljit_asm;
+
+void ljit_bytes(ljit_asm *a, char const *bytes, int n) {
+  if (a->count + n + 8 > a->capacity) {
+    a->capacity = (a->count + n + 8) * 2;
+    a->ops = realloc(a->ops, a->capacity);
+  }
+  memcpy(a->ops + a->count, bytes, n);
+  a->count += n;
+}
+
+void ljit_imm(ljit_asm *a, long v, int size) {
+  for (int i = 0; i < size; i++) {
+    char b = (v >> (8 * i)) & 0xff;
+    ljit_bytes(a, &b, 1);
+  }
+}
+
+/* Jump or call with a 32-bit displacement to offset target */
+void ljit_jump(ljit_asm *a, char const *op, int n, int target) {
+  ljit_bytes(a, op, n);
+  ljit_imm(a, target - (a->count + 4), 4);
+}
+
+void ljit_free(ljit *j) {
+  if (j->mem) {
+    munmap(j->mem, j->size);
+  }
+  free(j);
+}
+
+/* Record that atom must stay bound to builtin, or to fun when builtin
+   is NULL. Fails if it is not bound so now. */
+int ljit_global(ljit *j, lval *fun, int atom, lbuiltin builtin) {
+  lenv *root = fun->env;
+  while (root->parent) {
+    root = root->parent;
+  }
+  int i = lenv_find(root, atom);
+  if (i < 0) {
+    return 0;
+  }
+  lval *v = root->vals[i];
+  if (builtin ? lval_type(v) != LVAL_FUN || v->builtin != builtin
+      : v != fun) {
+    return 0;
+  }
+
+  for (int g = 0; g < j->count; g++) {
+    if (j->atoms[g] == atom) {
+      return 1;
+    }
+  }
+  if (j->count == LJIT_GLOBALS) {
+    return 0;
+  }
+  j->atoms[j->count] = atom;
+  j->builtins[j->count] = builtin;
+  j->count++;
+  return 1;
+}
+
+int ljit_sexpr(ljit_asm *a, ljit *j, lval *fun, lval *v, int tail);
+
+/* Emit code leaving the value of v in rax, or return 0 if v is beyond
+   the JIT */
+int ljit_expr(ljit_asm *a, ljit *j, lval *fun, lval *v, int tail) {
+  switch (lval_type(v)) {
+  case LVAL_NUM:
+    ljit_bytes(a, "\x48\xb8", 2);                 // mov rax, imm64
+    ljit_imm(a, lval_get_num(v), 8);
+    return 1;
+  case LVAL_SYM:
+    if (v->slot < 0 || v->depth != 0) {
+      return 0;
+    }
+    ljit_bytes(a, "\x48\x8b\x83", 3);             // mov rax, [rbx + disp]
+    ljit_imm(a, 8 * (fun->arity - 1 - v->slot), 4);
+    return 1;
+  case LVAL_SEXPR:
+    return ljit_sexpr(a, j, fun, v, tail);
+  default:
+    return 0;
+  }
+}
+
+int ljit_sexpr(ljit_asm *a, ljit *j, lval *fun, lval *v, int tail) {
+  if (v->count == 0) {
+    return 0;
+  }
+  if (v->count == 1) {
+    return ljit_expr(a, j, fun, v->cell[0], tail);
+  }
+
+  lval *f = v->cell[0];
+  if (lval_type(f) != LVAL_SYM || f->slot >= 0) {
+    return 0;
+  }
+  char const *name = latom_name(f->atom);
+  lbuiltin op = NULL;
+  if (name[0] && !name[1]) {
+    switch (name[0]) {
+    case '+': op = builtin_add; break;
+    case '-': op = builtin_sub; break;
+    case '*': op = builtin_mul; break;
+    case '/': op = builtin_div; break;
+    }
+  }
+
+  // a call of fun itself
+  if (!op) {
+    if (v->count - 1 != fun->arity || !ljit_global(j, fun, f->atom, NULL)) {
+      return 0;
+    }
+    for (int i = 1; i < v->count; i++) {
+      if (!ljit_expr(a, j, fun, v->cell[i], 0)) {
+        return 0;
+      }
+      ljit_bytes(a, "\x50", 1);                     // push rax
+    }
+    if (tail) {
+      for (int i = 0; i < fun->arity; i++) {
+        ljit_bytes(a, "\x58\x48\x89\x83", 4);     // pop rax
+        ljit_imm(a, 8 * i, 4);                     // mov [rbx + disp], rax
+      }
+      ljit_jump(a, "\xe9", 1, a->loop);             // jmp loop
+    } else {
+      j->recurses = 1;
+      ljit_bytes(a, "\x48\x89\xe7", 3);            // mov rdi, rsp
+      ljit_jump(a, "\xe8", 1, a->body);             // call body
+      ljit_bytes(a, "\x48\x81\xc4", 3);            // add rsp, imm32
+      ljit_imm(a, 8 * fun->arity, 4);
+    }
+    return 1;
+  }
+
+  if (!ljit_global(j, fun, f->atom, op) || !ljit_expr(a, j, fun, v->cell[1], 0)) {
+    return 0;
+  }
+  if (v->count == 2) {
+    if (name[0] == '-') {
+      ljit_bytes(a, "\x48\xf7\xd8", 3);            // neg rax
+      ljit_jump(a, "\x0f\x80", 2, a->bail);         // jo bail
+    }
+    return 1;
+  }
+
+  ljit_bytes(a, "\x50", 1);                         // push rax
+  for (int i = 2; i < v->count; i++) {
+    if (!ljit_expr(a, j, fun, v->cell[i], 0)) {
+      return 0;
+    }
+    ljit_bytes(a, "\x48\x89\xc1\x58", 4);          // mov rcx, rax; pop rax
+    switch (name[0]) {
+    case '+':
+      ljit_bytes(a, "\x48\x01\xc8", 3);            // add rax, rcx
+      ljit_jump(a, "\x0f\x80", 2, a->bail);         // jo bail
+      break;
+    case '-':
+      ljit_bytes(a, "\x48\x29\xc8", 3);            // sub rax, rcx
+      ljit_jump(a, "\x0f\x80", 2, a->bail);         // jo bail
+      break;
+    case '*':
+      ljit_bytes(a, "\x48\x0f\xaf\xc1", 4);        // imul rax, rcx
+      ljit_jump(a, "\x0f\x80", 2, a->bail);         // jo bail
+      break;
+    case '/':
+      ljit_bytes(a, "\x48\x85\xc9", 3);            // test rcx, rcx
+      ljit_jump(a, "\x0f\x84", 2, a->bail);         // jz bail
+      // rcx == -1: negate, as idiv traps on LONG_MIN / -1
+      ljit_bytes(a, "\x48\x83\xf9\xff\x75\x0b", 6); // cmp rcx, -1; jne 1f
+      ljit_bytes(a, "\x48\xf7\xd8", 3);            // neg rax
+      ljit_jump(a, "\x0f\x80", 2, a->bail);         // jo bail
+      ljit_bytes(a, "\xeb\x05", 2);                 // jmp 2f
+      ljit_bytes(a, "\x48\x99\x48\xf7\xf9", 5);     // 1: cqo; idiv rcx
+      break;                                       // 2:
+    }
+    ljit_bytes(a, "\x50", 1);                       // push rax
+  }
+  ljit_bytes(a, "\x58", 1);                         // pop rax
+  return 1;
+}
+
+/* Native code for lambda fun, or NULL if its body is beyond the JIT */
+ljit *ljit_compile(lval *fun) {
+#if defined(__x86_64__)
+  if (!ljit_enabled || fun->arity < 1 || fun->arity > LJIT_ARGS
+      || fun->variadic) {
+    return NULL;
+  }
+
+  ljit *j = malloc(sizeof(ljit));
+  j->count = 0;
+  j->recurses = 0;
+  j->off = 0;
+  ljit_asm a = { NULL, 0, 0 };
+
+  // entry(args, out, budget), called from C
+  ljit_bytes(&a, "\x53\x41\x54\x41\x55\x41\x56", 7); // push rbx, r12-r14
+  ljit_bytes(&a, "\x49\x89\xf4", 3);               // mov r12, rsi
+  ljit_bytes(&a, "\x49\x89\xd6", 3);               // mov r14, rdx
+  ljit_bytes(&a, "\x49\x89\xe5", 3);               // mov r13, rsp
+  int call = a.count;
+  ljit_bytes(&a, "\xe8\0\0\0\0", 5);              // call body
+  ljit_bytes(&a, "\x49\x89\x04\x24", 4);           // mov [r12], rax
+  ljit_bytes(&a, "\x31\xc0", 2);                    // xor eax, eax
+  int exit = a.count;
+  ljit_bytes(&a, "\x41\x5e\x41\x5d\x41\x5c\x5b\xc3", 8); // pop r14-r12, rbx; ret
+  a.bail = a.count;
+  ljit_bytes(&a, "\xb8", 1);                        // mov eax, LJIT_BAIL
+  ljit_imm(&a, LJIT_BAIL, 4);
+  ljit_bytes(&a, "\x4c\x89\xec", 3);               // mov rsp, r13
+  ljit_jump(&a, "\xe9", 1, exit);
+  a.deep = a.count;
+  ljit_bytes(&a, "\xb8", 1);                        // mov eax, LJIT_DEEP
+  ljit_imm(&a, LJIT_DEEP, 4);
+  ljit_bytes(&a, "\x4c\x89\xec", 3);               // mov rsp, r13
+  ljit_jump(&a, "\xe9", 1, exit);
+
+  // body(args), with rsp at most r14 bytes below the entry's
+  a.body = a.count;
+  ljit_bytes(&a, "\x53\x48\x89\xfb", 4);           // push rbx; mov rbx, rdi
+  ljit_bytes(&a, "\x4c\x89\xe8\x48\x29\xe0", 6);   // mov rax, r13; sub rax, rsp
+  ljit_bytes(&a, "\x4c\x39\xf0", 3);               // cmp rax, r14
+  ljit_jump(&a, "\x0f\x87", 2, a.deep);             // ja deep
+  a.loop = a.count;
+  int ok = ljit_sexpr(&a, j, fun, fun->body, 1);
+  ljit_bytes(&a, "\x5b\xc3", 2);                    // pop rbx; ret
+
+  int rel = a.body - (call + 5);
+  memcpy(a.ops + call + 1, &rel, 4);
+
+  j->mem = MAP_FAILED;
+  if (ok) {
+    j->size = a.count;
+    j->mem = mmap(NULL, j->size, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  }
+  if (j->mem == MAP_FAILED) {
+    free(a.ops);
+    free(j);
+    return NULL;
+  }
+  memcpy(j->mem, a.ops, a.count);
+  free(a.ops);
+  mprotect(j->mem, j->size, PROT_READ | PROT_EXEC);
+  j->entry = (int (*)(long *, long *, long))j->mem;
+
+  // the cells of the globals, found the first time it runs
+  j->version = 0;
+  return j;
+#else
+  return NULL;
+#endif
+}
+
+/* Whether the globals the code of fun takes as given still are */
+int ljit_valid(ljit *j, lval *fun) {
+  if (j->version != lglobal_version) {
+    lenv *root = fun->env;
+    while (root->parent) {
+      root = root->parent;
+    }
+    for (int g = 0; g < j->count; g++) {
+      int i = lenv_find(root, j->atoms[g]);
+      if (i < 0) {
+        return 0;
+      }
+      j->cells[g] = &root->vals[i];
+    }
+    j->version = lglobal_version;
+  }
+
+  for (int g = 0; g < j->count; g++) {
+    lval *v = *j->cells[g];
+    if (j->builtins[g] ? lval_type(v) != LVAL_FUN
+        || v->builtin != j->builtins[g] : v != fun) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* Call fun natively on its arity args. Returns the value, or NULL if
+   it cannot run or bails out, with args updated to those of the self
+   call it had got to; frame is the env holding args, if any. */
+lval *ljit_run(lval *fun, lval **args, lenv *frame) {
+  ljit *j = fun->code->jit;
+  if (j->off || !ljit_valid(j, fun)) {
+    return NULL;
+  }
+
+  long raw[LJIT_ARGS];
+  int n = fun->arity;
+  for (int i = 0; i < n; i++) {
+    if (lval_type(args[i]) != LVAL_NUM) {
+      return NULL;
+    }
+    raw[n - 1 - i] = lval_get_num(args[i]);
+  }
+
+  // leave some of the native stack for the interpreter to bail out to
+  long budget = lstack_c_limit / 2
+    - (lstack_c_base - (char *)__builtin_frame_address(0));
+  if (budget <= 0) {
+    return NULL;
+  }
+
+  long out;
+  ljit_calls++;
+  int status = j->entry(raw, &out, budget);
+  if (status == LJIT_OK) {
+    return lval_num(out);
+  }
+
+  // interpreting a recursive call would enter it again at every level
+  // down to where it bailed out
+  ljit_bails++;
+  if (status == LJIT_DEEP || j->recurses) {
+    j->off = 1;
+  }
+  for (int i = 0; i < n; i++) {
+    if (lval_get_num(args[i]) != raw[n - 1 - i]) {
+      lval_del(args[i]);
+      args[i] = lval_num(raw[n - 1 - i]);
+      if (frame) {
+        lgc_write_env(frame, args[i]);
+      }
+    }
+  }
+  return NULL;
+}
+
+/* Runtime of the C programs written by --emit-c, see lemit_c. The C
+   functions of numeric lambdas take the place of JIT code: they have
+   the same entry and the same guards, and bail out by a longjmp from
+   the arithmetic that overflows or divides by zero. */
+
+jmp_buf lemit_exit;
+char *lemit_floor;   // lowest native stack address the code may use
+
+long lemit_add(long x, long y) {
+  long z;
+  if (__builtin_add_overflow(x, y, &z)) {
+    longjmp(lemit_exit, LJIT_BAIL);
+  }
+  return z;
+}
+
+long lemit_sub(long x, long y) {
+  long z;
+  if (__builtin_sub_overflow(x, y, &z)) {
+    longjmp(lemit_exit, LJIT_BAIL);
+  }
+  return z;
+}
+
+long lemit_mul(long x, long y) {
+  long z;
+  if (__builtin_mul_overflow(x, y, &z)) {
+    longjmp(lemit_exit, LJIT_BAIL);
+  }
+  return z;
+}
+
+long lemit_neg(long x) {
+  return lemit_sub(0, x);
+}
+
+long lemit_div(long x, long y) {
+  if (y == 0) {
+    longjmp(lemit_exit, LJIT_BAIL);
   }
+  return y == -1 ? lemit_neg(x) : x / y;
+}
 
-  // empty expression
-  if (v->count == 0) {
-    return v;
+/* Called first by every body, which may recurse */
+void lemit_check(void) {
+  if ((char *)__builtin_frame_address(0) < lemit_floor) {
+    longjmp(lemit_exit, LJIT_DEEP);
   }
+}
 
-  // single expression
-  if (v->count == 1) {
-    return lval_take(v, 0);
+/* A list of the n values after n */
+lval *lemit_list(lval *v, int n, ...) {
+  lval_reserve(v, n);
+  va_list va;
+  va_start(va, n);
+  for (int i = 0; i < n; i++) {
+    lval_add_cell(v, va_arg(va, lval *));
+  }
+  va_end(va);
+  return v;
+}
+
+/* The entry of a compiled lambda, running body on args */
+int lemit_run(long (*body)(long *), long *args, long *out, long budget) {
+  lemit_floor = (char *)__builtin_frame_address(0) - budget;
+  int status = setjmp(lemit_exit);
+  if (status == LJIT_OK) {
+    *out = body(args);
   }
+  return status;
+}
 
-  lval *fun = lval_pop(v, 0);
-  if (fun->type != LVAL_FUN) {
-    lval *err = lval_err("S-Expression starts with incorrect type. "
-                         "Got %s, Expected %s.",
-                         ltype_name(fun->type), ltype_name(LVAL_FUN));
-    lval_del(fun);
-    lval_del(v);
-    return err;
+/* Give the lambda just bound to name the C function entry as native
+   code, which takes the builtins of ops and, if self is set, name
+   itself as given */
+void lemit_attach(lenv *e, char const *name,
+                  int (*entry)(long *, long *, long), int arity,
+                  char const *ops, int self, int recurses) {
+  // the line defined name only if def and \ are still the builtins
+  int def = lenv_find(e, latom_intern("def"));
+  int lambda = lenv_find(e, latom_intern("\\"));
+  int atom = latom_intern(name);
+  int i = lenv_find(e, atom);
+  if (!ljit_enabled || lengine == LENGINE_TREE || def < 0 || lambda < 0
+      || lval_type(e->vals[def]) != LVAL_FUN
+      || e->vals[def]->builtin != builtin_def
+      || lval_type(e->vals[lambda]) != LVAL_FUN
+      || e->vals[lambda]->builtin != builtin_lambda
+      || i < 0 || lval_type(e->vals[i]) != LVAL_FUN
+      || e->vals[i]->builtin || e->vals[i]->arity != arity
+      || e->vals[i]->variadic) {
+    return;
   }
+  lval *fun = e->vals[i];
 
-  lval *result = lval_call(e, fun, v);
-  lval_del(fun);
+  ljit *j = malloc(sizeof(ljit));
+  j->entry = entry;
+  j->mem = NULL;
+  j->size = 0;
+  j->recurses = recurses;
+  j->off = 0;
+  j->count = 0;
+  j->version = 0;
+  int ok = !self || ljit_global(j, fun, atom, NULL);
+  for (int o = 0; ops[o]; o++) {
+    char op[2] = { ops[o], '\0' };
+    lbuiltin builtin = ops[o] == '+' ? builtin_add
+      : ops[o] == '-' ? builtin_sub
+      : ops[o] == '*' ? builtin_mul : builtin_div;
+    ok = ok && ljit_global(j, fun, latom_intern(op), builtin);
+  }
+  if (!ok) {
+    free(j);
+    return;
+  }
 
-  return result;
+  if (!fun->code) {
+    fun->code = lcode_compile(fun->body);
+  }
+  if (fun->code->jit) {
+    ljit_free(fun->code->jit);
+  }
+  fun->code->jit = j;
 }
 
-lval *lval_eval(lenv *e, lval *v) {
-  if (v->type == LVAL_SYM) {
-    lval *x = lenv_get(e, v);
+/* Evaluate v as an S-Expression with the selected engine */
+lval *lval_run(lenv *e, lval *v) {
+  if (lengine == LENGINE_VM || lengine == LENGINE_CLOSURE) {
+    lcode *c = lcode_compile(v);
     lval_del(v);
+    lval *x = lengine == LENGINE_VM ? lvm_run(e, c) : lnode_run(e, c);
+    lcode_del(c);
     return x;
   }
-  if (v->type == LVAL_SEXPR) {
-    return lval_eval_sexpr(e, v);
-  }
-  return v;
+  v = lval_unshare(v);
+  v->type = LVAL_SEXPR;
+  return lval_eval(e, v);
 }
 
 lval *builtin_list(lenv *e, lval *arg) {
@@ -526,20 +3584,18 @@ lval *builtin_head(lenv *e, lval *arg) {
 	  "Function 'head' passed too many arguments. "
 	  "Got %i, Expected %i.",
 	  arg->count, 1);
-  LASSERT(arg, arg->cell[0]->type == LVAL_QEXPR,
+  LASSERT(arg, lval_type(arg->cell[0]) == LVAL_QEXPR,
 	  "Function 'head' passed incorrect type for argument 0. "
 	  "Got %s, Expected %s.",
-	  ltype_name(arg->cell[0]->type), ltype_name(LVAL_QEXPR));
+	  ltype_name(lval_type(arg->cell[0])), ltype_name(LVAL_QEXPR));
   LASSERT(arg, arg->cell[0]->count > 0,
 	  "Function 'head' passed {}");
 
   lval *first = lval_take(arg, 0);
+  lval *x = lval_add_cell(lval_qexpr(), lval_copy(first->cell[0]));
+  lval_del(first);
 
-  while (first->count > 1) {
-    lval_pop(first, 1);
-  }
-
-  return first;
+  return x;
 }
 
 lval *builtin_tail(lenv *e, lval *arg) {
@@ -547,27 +3603,24 @@ lval *builtin_tail(lenv *e, lval *arg) {
 	  "Function 'tail' passed too many arguments. "
 	  "Got %i, Expected %i.",
 	  arg->count, 1);
-  LASSERT(arg, arg->cell[0]->type == LVAL_QEXPR,
+  LASSERT(arg, lval_type(arg->cell[0]) == LVAL_QEXPR,
 	  "Function 'tail' passed incorrect type for argument 0. "
 	  "Got %s, Expected %s.",
-	  ltype_name(arg->cell[0]->type), ltype_name(LVAL_QEXPR));
+	  ltype_name(lval_type(arg->cell[0])), ltype_name(LVAL_QEXPR));
   LASSERT(arg, arg->cell[0]->count > 0,
 	  "Function 'tail' passed {}");
 
-  printf("tail: arg="); lval_print(arg); putchar('\n');
-  lval* arg0 = lval_take(arg, 0);
-  printf("tail: arg0="); lval_print(arg0); putchar('\n');
+  lval* arg0 = lval_unshare(lval_take(arg, 0));
   lval_del(lval_pop(arg0, 0));
-  printf("tail: arg="); lval_print(arg); putchar('\n');
   return arg0;
 }
 
 lval *builtin_join(lenv *e, lval *arg) {
   for (int i = 0; i < arg->count; i++) {
-    LASSERT(arg, arg->cell[i]->type == LVAL_QEXPR,
+    LASSERT(arg, lval_type(arg->cell[i]) == LVAL_QEXPR,
 	    "Function 'join' passed incorrect types");
   }
-  lval *x = lval_pop(arg, 0);
+  lval *x = lval_unshare(lval_pop(arg, 0));
 
   while (arg->count > 0) {
     x = lval_join(x, lval_pop(arg, 0));
@@ -582,22 +3635,20 @@ lval *builtin_eval(lenv *e, lval *arg) {
   LASSERT(arg, arg->count == 1,
     "Function 'eval' passed too many arguments");
 
-  lval *arg0 = arg->cell[0];
-  LASSERT(arg, arg0->type == LVAL_QEXPR,
+  LASSERT(arg, lval_type(arg->cell[0]) == LVAL_QEXPR,
     "Function 'eval' passed incorrect type");
 
-  arg0->type = LVAL_SEXPR;
-  return lval_eval(e, arg0);
+  return lval_run(e, lval_take(arg, 0));
 }
 
 lval *builtin_var(lenv *e, lval *arg, char *func) {
-  LASSERT(arg, arg->cell[0]->type == LVAL_QEXPR,
+  LASSERT(arg, lval_type(arg->cell[0]) == LVAL_QEXPR,
 	  "Function 'def' passed incorrect type");
 
   lval *syms = arg->cell[0];
 
   for (int i = 0; i < syms->count; i++) {
-    LASSERT(arg, syms->cell[i]->type == LVAL_SYM,
+    LASSERT(arg, lval_type(syms->cell[i]) == LVAL_SYM,
 	    "Function 'def' cannot define non-symbol");
   }
 
@@ -606,12 +3657,23 @@ lval *builtin_var(lenv *e, lval *arg, char *func) {
 	  "number of values to symbols");
 
   for (int i = 0; i < syms->count; i++) {
-    if (strcmp(func, "def") == 0) {
+    int atom = syms->cell[i]->atom;
+    LASSERT(arg, !latom_const[atom],
+            "Cannot redefine constant '%s'", latom_name(atom));
+  }
+
+  for (int i = 0; i < syms->count; i++) {
+    if (strcmp(func, "def") == 0 || strcmp(func, "const") == 0) {
       lenv_def(e, syms->cell[i], arg->cell[i + 1]);
     } else if (strcmp(func, "=") == 0) {
       lenv_put(e, syms->cell[i], arg->cell[i + 1]);
     }
   }
+  if (strcmp(func, "const") == 0) {
+    for (int i = 0; i < syms->count; i++) {
+      latom_const[syms->cell[i]->atom] = 1;
+    }
+  }
 
   lval_del(arg);
   return lval_sexpr();
@@ -625,59 +3687,144 @@ lval *builtin_put(lenv *e, lval *arg) {
   return builtin_var(e, arg, "=");
 }
 
-lval *builtin_op(lenv *e, lval *arg, char* op) {
-  // Ensure all arguments are numbers
-  for (int i = 0; i < arg->count; i++) {
-    LASSERT(arg, arg->cell[i]->type == LVAL_NUM, "Cannot operate on non-number");
-  }
-
-  lval *x = lval_pop(arg, 0);
-
-  if ((strcmp(op, "-") == 0) && (arg->count == 0)) {
-    x->num = - x->num;
-  }
-
-  while (arg->count > 0) {
-    lval *y = lval_pop(arg, 0);
-    if (strcmp(op, "+") == 0) {
-      x->num += y->num;
-    }
-    if (strcmp(op, "-") == 0) {
-      x->num -= y->num;
-    }
-    if (strcmp(op, "*") == 0) {
-      x->num *= y->num;
-    }
-    if (strcmp(op, "/") == 0) {
-      if (y->num == 0) {
-	lval_del(x);
-	lval_del(y);
-	x = lval_err("Division by zero");
-	break;
-      }
-      x->num /= y->num;
-    }
-    lval_del(y);
-  }
+lval *builtin_const(lenv *e, lval *arg) {
+  return builtin_var(e, arg, "const");
+}
 
+lval *builtin_op(lenv *e, lval *arg, char op) {
+  lval *x = lval_arith(op, arg->cell, arg->count);
   lval_del(arg);
   return x;
 }
 
 lval *builtin_add(lenv *e, lval *arg) {
-  return builtin_op(e, arg, "+");
+  return builtin_op(e, arg, '+');
 }
 
 lval *builtin_sub(lenv *e, lval *arg) {
-  return builtin_op(e, arg, "-");
+  return builtin_op(e, arg, '-');
 }
 
 lval *builtin_mul(lenv *e, lval *arg) {
-  return builtin_op(e, arg, "*");
+  return builtin_op(e, arg, '*');
 }
 
 lval *builtin_div(lenv *e, lval *arg) {
-  return builtin_op(e, arg, "/");
+  return builtin_op(e, arg, '/');
+}
+
+/* Slot of atom among the formals, in binding order skipping '&' and
+   rebinds, or -1 */
+int lval_formal_slot(lval *formals, int atom) {
+  int slot = 0;
+  for (int j = 0; j < formals->count; j++) {
+    int a = formals->cell[j]->atom;
+    int seen = a == latom_amp;
+    for (int k = 0; k < j && !seen; k++) {
+      seen = formals->cell[k]->atom == a;
+    }
+    if (seen) {
+      continue;
+    }
+    if (a == atom) {
+      return slot;
+    }
+    slot++;
+  }
+  return -1;
+}
+
+/* Copy into env the symbols of v bound in the frames between e and
+   the global env, other than formals. Quoted sub-expressions count
+   too, since the body may eval them. */
+void lenv_capture(lenv *env, lenv *e, lval *formals, lval *v) {
+  for (int i = 0; i < v->count; i++) {
+    lval *x = v->cell[i];
+    if (lval_type(x) == LVAL_SEXPR || lval_type(x) == LVAL_QEXPR) {
+      lenv_capture(env, e, formals, x);
+    }
+    if (lval_type(x) != LVAL_SYM
+        || lenv_find(env, x->atom) >= 0
+        || lval_formal_slot(formals, x->atom) >= 0) {
+      continue;
+    }
+    for (lenv *f = e; f->parent; f = f->parent) {
+      int j = lenv_find(f, x->atom);
+      if (j >= 0) {
+        lenv_put(env, x, f->vals[j]);
+        break;
+      }
+    }
+  }
+}
+
+/* Rewrite references in the code positions of v to (depth, slot)
+   addresses: formals in the call's frame at depth 0, captured
+   variables in the closure's env at depth 1. Other names are globals
+   and still looked up by name. Quoted sub-expressions are data and
+   left alone. */
+lval *lval_resolve(lval *v, lval *formals, lenv *env) {
+  v = lval_unshare(v);
+  for (int i = 0; i < v->count; i++) {
+    lval *x = v->cell[i];
+    if (lval_type(x) == LVAL_SEXPR) {
+      v->cell[i] = lval_resolve(x, formals, env);
+      lgc_write(v, v->cell[i]);
+    }
+    if (lval_type(x) != LVAL_SYM) {
+      continue;
+    }
+
+    int depth = 0;
+    int slot = lval_formal_slot(formals, x->atom);
+    if (slot < 0 && env) {
+      depth = 1;
+      slot = lenv_find(env, x->atom);
+    }
+    if (slot < 0) {
+      depth = 0;
+    }
+    // addresses left from another function would be stale here
+    if (x->depth != depth || x->slot != slot) {
+      x = v->cell[i] = lval_unshare(x);
+      lgc_write(v, x);
+      x->depth = depth;
+      x->slot = slot;
+    }
+  }
+  return v;
+}
+
+/* Replace the names of constants in the code positions of v by their
+   values, if a number or a quoted list, unless a frame between e and
+   the global env binds them: the closure would capture those */
+lval *lval_inline(lval *v, lenv *e, lenv *global) {
+  v = lval_unshare(v);
+  for (int i = 0; i < v->count; i++) {
+    lval *x = v->cell[i];
+    if (lval_type(x) == LVAL_SEXPR) {
+      v->cell[i] = lval_inline(x, e, global);
+      lgc_write(v, v->cell[i]);
+      continue;
+    }
+    if (lval_type(x) != LVAL_SYM || !latom_const[x->atom]) {
+      continue;
+    }
+
+    int bound = 0;
+    for (lenv *f = e; f->parent && !bound; f = f->parent) {
+      bound = lenv_find(f, x->atom) >= 0;
+    }
+    int j = lenv_find(global, x->atom);
+    if (bound || j < 0 || (lval_type(global->vals[j]) != LVAL_NUM
+                           && lval_type(global->vals[j]) != LVAL_QEXPR)) {
+      continue;
+    }
+    v->cell[i] = lval_copy(global->vals[j]);
+    lgc_write(v, v->cell[i]);
+    lval_del(x);
+  }
+  return v;
 }
 
 lval *builtin_lambda(lenv *e, lval *arg) {
@@ -688,19 +3835,43 @@ lval *builtin_lambda(lenv *e, lval *arg) {
   lval *syms = arg->cell[0];
   for (int i = 0; i < syms->count; i++) {
     LASSERT(arg,
-            syms->cell[i]->type == LVAL_SYM,
+            lval_type(syms->cell[i]) == LVAL_SYM,
             "Cannot define non-symbol. Got %s, Expected %s.",
-            ltype_name(syms->cell[i]->type), ltype_name(LVAL_SYM));
+            ltype_name(lval_type(syms->cell[i])), ltype_name(LVAL_SYM));
+    LASSERT(arg, !latom_const[syms->cell[i]->atom],
+            "Cannot bind constant '%s'",
+            latom_name(syms->cell[i]->atom));
   }
 
   lval *formals = lval_pop(arg, 0);
   lval *body = lval_pop(arg, 0);
   lval_del(arg);
 
-  return lval_lambda(formals, body);
+  lenv *global = e;
+  while (global->parent) {
+    global = global->parent;
+  }
+  body = lval_inline(body, e, global);
+
+  // scope is lexical: the closure keeps the free variables bound in
+  // the enclosing frames, and the globals above them
+  lenv *env = NULL;
+  if (e != global) {
+    env = lenv_new();
+    lgc_write_parent(env, global);
+    lenv_capture(env, e, formals, body);
+    if (env->count == 0) {
+      env = NULL;
+    }
+  }
+
+  return lval_lambda(env ? env : global, formals,
+                     lval_resolve(body, formals, env));
 }
 
 void lenv_add_builtins(lenv *e) {
+  latom_amp = latom_intern("&");
+
   lenv_add_builtin(e, "list", builtin_list);
   lenv_add_builtin(e, "head", builtin_head);
   lenv_add_builtin(e, "tail", builtin_tail);
@@ -708,6 +3879,7 @@ void lenv_add_builtins(lenv *e) {
   lenv_add_builtin(e, "eval", builtin_eval);
   lenv_add_builtin(e, "def", builtin_def);
   lenv_add_builtin(e, "=", builtin_put);
+  lenv_add_builtin(e, "const", builtin_const);
   lenv_add_builtin(e, "\\", builtin_lambda);
 
   lenv_add_builtin(e, "+", builtin_add);
@@ -716,7 +3888,547 @@ void lenv_add_builtins(lenv *e) {
   lenv_add_builtin(e, "/", builtin_div);
 }
 
+/* Global lookup time as the environment grows */
+void lbench_env(void) {
+  int sizes[] = { 10, 100, 1000, 10000, 100000 };
+  int lookups = 1000000;
+
+  printf("%10s %12s %12s\n", "globals", "ns/lookup", "ns/cached");
+  for (int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    int n = sizes[s];
+    lenv *e = lenv_new();
+    lval **keys = malloc(sizeof(lval *) * n);
+    for (int i = 0; i < n; i++) {
+      char name[32];
+      snprintf(name, sizeof(name), "g%d", i);
+      keys[i] = lval_sym(name);
+      lval *v = lval_num(i);
+      lenv_put(e, keys[i], v);
+      lval_del(v);
+    }
+
+    double start = ltime_now();
+    for (int i = 0; i < lookups; i++) {
+      lval *k = keys[(i * 7919L) % n];
+      k->cached = 0;
+      lval_del(lenv_get(e, k));
+    }
+    double elapsed = ltime_now() - start;
+
+    start = ltime_now();
+    for (int i = 0; i < lookups; i++) {
+      lval_del(lenv_get(e, keys[(i * 7919L) % n]));
+    }
+    double cached = ltime_now() - start;
+    printf("%10d %12.1f %12.1f\n", n, elapsed * 1e9 / lookups,
+           cached * 1e9 / lookups);
+
+    for (int i = 0; i < n; i++) {
+      lval_del(keys[i]);
+    }
+    free(keys);
+  }
+}
+
+/* Run time of each engine on small programs. Every line is a loop that
+   counts down by tail calls and stops with a division by zero. */
+void lbench_engines(mpc_parser_t *program) {
+  char const *programs[][4] = {
+    { "tail calls",
+      "def {count} (\\ {n} {count (- n (/ n n))})",
+      "count 300000" },
+    { "arithmetic",
+      "def {f} (\\ {n} {f (- (+ n (* 2 3) (/ 9 3)) (- 10 1) (/ n n))})",
+      "f 300000" },
+    { "calls",
+      "def {add} (\\ {a b} {+ a b})",
+      "def {g} (\\ {n} {g (add n (add -1 (/ 0 n)))})",
+      "g 300000" },
+    { "partials",
+      "def {add3} (\\ {a b c} {+ a b c})",
+      "def {h} (\\ {n} {h ((add3 n) -1 (/ 0 n))})",
+      "h 300000" },
+    { "eval",
+      "def {ev} (\\ {n} {eval {ev (- n (/ n n))}})",
+      "ev 100000" },
+  };
+  int engines[] = { LENGINE_TREE, LENGINE_VM, LENGINE_CLOSURE,
+                    LENGINE_TIERED };
+
+  printf("%-12s %10s %10s %10s %10s\n", "ms", "tree", "vm", "closure",
+         "tiered");
+  for (int p = 0; p < sizeof(programs) / sizeof(programs[0]); p++) {
+    printf("%-12s", programs[p][0]);
+    for (int g = 0; g < 4; g++) {
+      lengine = engines[g];
+      lgc_global = lenv_new();
+      lenv_add_builtins(lgc_global);
+
+      double start = ltime_now();
+      for (int l = 1; l < 4 && programs[p][l]; l++) {
+        mpc_result_t r;
+        if (mpc_parse("<bench>", programs[p][l], program, &r)) {
+          lval_del(lval_run(lgc_global, lval_read(r.output)));
+          mpc_ast_delete(r.output);
+          lgc_poll();
+        }
+      }
+      printf(" %10.1f", (ltime_now() - start) * 1e3);
+    }
+    printf("\n");
+  }
+}
+
+/* Ahead-of-time compilation to C, see lemit_attach. Lambdas are
+   compiled where a line is just def of a lambda literal. */
+
+typedef struct {
+  FILE *out;
+  int index;      // of the C function
+  int self;       // atom of the name it is defined as
+  lval *formals;
+  char ops[5];    // the builtins it takes as given
+  int calls;      // self calls, and those not in tail position
+  int recurses;
+} lemit_lambda;
+
+void lemit_string(FILE *out, char const *s) {
+  fputc('"', out);
+  for (; *s; s++) {
+    if (*s == '"' || *s == '\\') {
+      fputc('\\', out);
+    }
+    fputc(*s, out);
+  }
+  fputc('"', out);
+}
+
+/* C building the value v as read */
+void lemit_form(FILE *out, lval *v) {
+  switch (lval_type(v)) {
+  case LVAL_NUM:
+    if (lval_get_num(v) == LONG_MIN) {
+      fprintf(out, "lval_num(LONG_MIN)");
+    } else {
+      fprintf(out, "lval_num(%ldL)", lval_get_num(v));
+    }
+    break;
+  case LVAL_ERR:
+    fprintf(out, "lval_err(");
+    lemit_string(out, v->err);
+    fprintf(out, ")");
+    break;
+  case LVAL_SYM:
+    fprintf(out, "lval_sym(");
+    lemit_string(out, latom_name(v->atom));
+    fprintf(out, ")");
+    break;
+  default: {
+    char const *list = lval_type(v) == LVAL_SEXPR
+      ? "lval_sexpr()" : "lval_qexpr()";
+    if (v->count == 0) {
+      fputs(list, out);
+      break;
+    }
+    fprintf(out, "lemit_list(%s, %d", list, v->count);
+    for (int i = 0; i < v->count; i++) {
+      fprintf(out, ", ");
+      lemit_form(out, v->cell[i]);
+    }
+    fprintf(out, ")");
+    break;
+  }
+  }
+}
+
+int lemit_formal(lemit_lambda *l, lval *v) {
+  if (lval_type(v) != LVAL_SYM) {
+    return -1;
+  }
+  for (int i = 0; i < l->formals->count; i++) {
+    if (l->formals->cell[i]->atom == v->atom) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/* Whether list v, when evaluated, calls the lambda with all its args */
+int lemit_self_call(lemit_lambda *l, lval *v) {
+  return v->count == l->formals->count + 1
+    && lval_type(v->cell[0]) == LVAL_SYM && v->cell[0]->atom == l->self
+    && lemit_formal(l, v->cell[0]) < 0;
+}
+
+int lemit_sexpr(lemit_lambda *l, lval *v);
+
+/* C for the value of v, or 0 if v is beyond the subset of ljit_expr */
+int lemit_expr(lemit_lambda *l, lval *v) {
+  switch (lval_type(v)) {
+  case LVAL_NUM:
+    if (lval_get_num(v) == LONG_MIN) {
+      fprintf(l->out, "LONG_MIN");
+    } else {
+      fprintf(l->out, "%ldL", lval_get_num(v));
+    }
+    return 1;
+  case LVAL_SYM:
+    if (lemit_formal(l, v) < 0) {
+      return 0;
+    }
+    fprintf(l->out, "a[%d]", l->formals->count - 1 - lemit_formal(l, v));
+    return 1;
+  case LVAL_SEXPR:
+    return lemit_sexpr(l, v);
+  default:
+    return 0;
+  }
+}
+
+int lemit_sexpr(lemit_lambda *l, lval *v) {
+  int n = l->formals->count;
+  if (v->count == 0) {
+    return 0;
+  }
+  if (v->count == 1) {
+    return lemit_expr(l, v->cell[0]);
+  }
+
+  if (lemit_self_call(l, v)) {
+    l->calls++;
+    l->recurses++;
+    fprintf(l->out, "lemit_fn%d_body((long[]){ ", l->index);
+    for (int i = n; i > 0; i--) {
+      if (!lemit_expr(l, v->cell[i])) {
+        return 0;
+      }
+      fprintf(l->out, i > 1 ? ", " : " })");
+    }
+    return 1;
+  }
+
+  lval *f = v->cell[0];
+  char const *name = lval_type(f) == LVAL_SYM ? latom_name(f->atom) : "";
+  if (!strchr("+-*/", name[0]) || !name[0] || name[1]
+      || lemit_formal(l, f) >= 0) {
+    return 0;
+  }
+  if (!strchr(l->ops, name[0])) {
+    strncat(l->ops, name, 1);
+  }
+  char const *op = name[0] == '+' ? "add" : name[0] == '-' ? "sub"
+    : name[0] == '*' ? "mul" : "div";
+
+  if (v->count == 2) {
+    fprintf(l->out, name[0] == '-' ? "lemit_neg(" : "(");
+    if (!lemit_expr(l, v->cell[1])) {
+      return 0;
+    }
+    fprintf(l->out, ")");
+    return 1;
+  }
+  for (int i = 2; i < v->count; i++) {
+    fprintf(l->out, "lemit_%s(", op);
+  }
+  if (!lemit_expr(l, v->cell[1])) {
+    return 0;
+  }
+  for (int i = 2; i < v->count; i++) {
+    fprintf(l->out, ", ");
+    if (!lemit_expr(l, v->cell[i])) {
+      return 0;
+    }
+    fprintf(l->out, ")");
+  }
+  return 1;
+}
+
+/* C functions for a lambda, written to l->out. Self calls in tail
+   position loop. Returns 0 if its body is beyond the subset. */
+int lemit_body(lemit_lambda *l, lval *body) {
+  int n = l->formals->count;
+  lval *t = body;
+  while (t->count == 1 && lval_type(t->cell[0]) == LVAL_SEXPR) {
+    t = t->cell[0];
+  }
+
+  fprintf(l->out, "long lemit_fn%d_body(long *a) {\n", l->index);
+  fprintf(l->out, "  lemit_check();\n");
+  if (lemit_self_call(l, t)) {
+    l->calls++;
+    fprintf(l->out, " loop:\n  {\n");
+    for (int i = 0; i < n; i++) {
+      fprintf(l->out, "    long t%d = ", i);
+      if (!lemit_expr(l, t->cell[i + 1])) {
+        return 0;
+      }
+      fprintf(l->out, ";\n");
+    }
+    for (int i = 0; i < n; i++) {
+      fprintf(l->out, "    a[%d] = t%d;\n", n - 1 - i, i);
+    }
+    fprintf(l->out, "  }\n  goto loop;\n}\n\n");
+  } else {
+    fprintf(l->out, "  return ");
+    if (!lemit_sexpr(l, body)) {
+      return 0;
+    }
+    fprintf(l->out, ";\n}\n\n");
+  }
+
+  fprintf(l->out, "int lemit_fn%d(long *args, long *out, long budget) {\n"
+          "  return lemit_run(lemit_fn%d_body, args, out, budget);\n}\n\n",
+          l->index, l->index);
+  return 1;
+}
+
+/* Whether line v is def of a lambda with fixed formals, which l is
+   made ready to compile */
+int lemit_def(lemit_lambda *l, lval *v) {
+  if (v->count != 3 || lval_type(v->cell[0]) != LVAL_SYM
+      || strcmp(latom_name(v->cell[0]->atom), "def") != 0
+      || lval_type(v->cell[1]) != LVAL_QEXPR || v->cell[1]->count != 1
+      || lval_type(v->cell[1]->cell[0]) != LVAL_SYM
+      || lval_type(v->cell[2]) != LVAL_SEXPR || v->cell[2]->count != 3) {
+    return 0;
+  }
+  lval *lambda = v->cell[2];
+  if (lval_type(lambda->cell[0]) != LVAL_SYM
+      || strcmp(latom_name(lambda->cell[0]->atom), "\\") != 0
+      || lval_type(lambda->cell[1]) != LVAL_QEXPR
+      || lval_type(lambda->cell[2]) != LVAL_QEXPR) {
+    return 0;
+  }
+  lval *formals = lambda->cell[1];
+  if (formals->count < 1 || formals->count > LJIT_ARGS) {
+    return 0;
+  }
+  for (int i = 0; i < formals->count; i++) {
+    if (lval_type(formals->cell[i]) != LVAL_SYM
+        || formals->cell[i]->atom == latom_amp) {
+      return 0;
+    }
+    for (int j = 0; j < i; j++) {
+      if (formals->cell[j]->atom == formals->cell[i]->atom) {
+        return 0;
+      }
+    }
+  }
+
+  l->self = v->cell[1]->cell[0]->atom;
+  l->formals = formals;
+  l->ops[0] = '\0';
+  l->calls = 0;
+  l->recurses = 0;
+  return 1;
+}
+
+/* Write a C program running the lines of the file at path to stdout.
+   It includes main.c with TLISP_NO_MAIN defined. Nothing is written if
+   a line does not parse. */
+int lemit_c(char const *path, mpc_parser_t *program) {
+  FILE *in = fopen(path, "r");
+  if (!in) {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    return 1;
+  }
+
+  // the lines go into main, after the functions
+  char *fns, *run;
+  size_t fns_size, run_size;
+  FILE *funcs = open_memstream(&fns, &fns_size);
+  FILE *lines = open_memstream(&run, &run_size);
+  lemit_lambda l;
+  l.index = 0;
+
+  char *line = NULL;
+  size_t capacity = 0;
+  ssize_t len;
+  int status = 0;
+  for (int number = 1; (len = getline(&line, &capacity, in)) >= 0;
+       number++) {
+    if (len > 0 && line[len - 1] == '\n') {
+      line[len - 1] = '\0';
+    }
+    char where[256];
+    snprintf(where, sizeof(where), "%s line %d", path, number);
+    mpc_result_t r;
+    if (!mpc_parse(where, line, program, &r)) {
+      mpc_err_print_to(r.error, stderr);
+      mpc_err_delete(r.error);
+      status = 1;
+      break;
+    }
+    lval *v = lval_read(r.output);
+    mpc_ast_delete(r.output);
+
+    int compiled = 0;
+    if (lemit_def(&l, v)) {
+      char *text;
+      size_t size;
+      l.out = open_memstream(&text, &size);
+      compiled = lemit_body(&l, v->cell[2]->cell[2]);
+      fclose(l.out);
+      if (compiled) {
+        fputs(text, funcs);
+      }
+      free(text);
+    }
+
+    fprintf(lines, compiled ? "  if (lmain_line(e, " : "  lmain_line(e, ");
+    lemit_form(lines, v);
+    fprintf(lines, compiled ? ")) {\n" : ");\n");
+    if (compiled) {
+      fprintf(lines, "    lemit_attach(e, ");
+      lemit_string(lines, latom_name(l.self));
+      fprintf(lines, ", lemit_fn%d, %d, \"%s\", %d, %d);\n  }\n",
+              l.index, l.formals->count, l.ops, l.calls > 0,
+              l.recurses > 0);
+      l.index++;
+    }
+    lval_del(v);
+  }
+  free(line);
+  fclose(in);
+  fclose(funcs);
+  fclose(lines);
+  if (status) {
+    free(fns);
+    free(run);
+    return status;
+  }
+
+  // with no conditionals, recursion only ends by bailing out
+  printf("/* %s compiled by tlisp --emit-c */\n"
+         "#define TLISP_NO_MAIN\n#include \"main.c\"\n\n"
+         "#if __GNUC__ >= 12\n"
+         "#pragma GCC diagnostic ignored \"-Winfinite-recursion\"\n"
+         "#endif\n\n%s", path, fns);
+  printf("int main(int argc, char *argv[]) {\n"
+         "  lmain_stack(__builtin_frame_address(0));\n"
+         "  lengine = LENGINE_TIERED;\n"
+         "  for (int i = 1; i < argc; i++) {\n"
+         "    if (!lmain_option(argv[i])) {\n"
+         "      fprintf(stderr, \"usage: %%s \" LMAIN_OPTIONS \"\\n\", argv[0]);\n"
+         "      return 1;\n"
+         "    }\n"
+         "  }\n\n"
+         "  lenv *e = lmain_env();\n"
+         "%s"
+         "  lmain_exit();\n"
+         "  return 0;\n"
+         "}\n", run);
+  free(fns);
+  free(run);
+  return 0;
+}
+
+#define LMAIN_OPTIONS "[--engine=tree|vm|closure|tiered] " \
+  "[--tier-threshold=CALLS] [--tier-stats] [--no-jit] " \
+  "[--gc-heap=BYTES] [--gc-nursery=BYTES] [--gc-pause=USEC] " \
+  "[--slab-reserve=SLABS] [--eval-stack=BYTES] [--gc-stats]"
+
+/* Apply a runtime option, or return 0 if arg is not one */
+int lmain_option(char const *arg) {
+  if (strcmp(arg, "--engine=tree") == 0) {
+    lengine = LENGINE_TREE;
+  } else if (strcmp(arg, "--engine=vm") == 0) {
+    lengine = LENGINE_VM;
+  } else if (strcmp(arg, "--engine=closure") == 0) {
+    lengine = LENGINE_CLOSURE;
+  } else if (strcmp(arg, "--engine=tiered") == 0) {
+    lengine = LENGINE_TIERED;
+  } else if (strncmp(arg, "--tier-threshold=", 17) == 0) {
+    ltier_threshold = atoi(arg + 17);
+  } else if (strcmp(arg, "--tier-stats") == 0) {
+    ltier_stats = 1;
+  } else if (strcmp(arg, "--no-jit") == 0) {
+    ljit_enabled = 0;
+  } else if (strncmp(arg, "--gc-heap=", 10) == 0) {
+    lgc_threshold = lgc_next = atol(arg + 10);
+  } else if (strncmp(arg, "--gc-nursery=", 13) == 0) {
+    lgc_nursery_chunks = atol(arg + 13) / LGC_CHUNK;
+    if (lgc_nursery_chunks < 1) {
+      lgc_nursery_chunks = 1;
+    }
+  } else if (strncmp(arg, "--gc-pause=", 11) == 0) {
+    lgc_budget = atol(arg + 11);
+  } else if (strncmp(arg, "--slab-reserve=", 15) == 0) {
+    lslab_reserve = atoi(arg + 15);
+  } else if (strncmp(arg, "--eval-stack=", 13) == 0) {
+    lstack_limit = atol(arg + 13);
+  } else if (strcmp(arg, "--gc-stats") == 0) {
+    lgc_stats = 1;
+  } else {
+    return 0;
+  }
+  return 1;
+}
+
+/* Bound native recursion below base, the frame of main */
+void lmain_stack(void *base) {
+  struct rlimit stack;
+  if (getrlimit(RLIMIT_STACK, &stack) == 0 && stack.rlim_cur != RLIM_INFINITY) {
+    lstack_c_limit = stack.rlim_cur - stack.rlim_cur / 8;
+  }
+  lstack_c_base = base;
+}
+
+lenv *lmain_env(void) {
+  lenv *e = lenv_new();
+  lenv_add_builtins(e);
+  lgc_global = e;
+  return e;
+}
+
+/* Run and print a line, returning 0 if it is an error */
+int lmain_line(lenv *e, lval *v) {
+  if (ltier_stats) {
+    ltier_switch(LTIER_INTERP);
+  }
+  lval *result = lval_run(e, v);
+  if (ltier_stats) {
+    ltier_switch(LTIER_IDLE);
+  }
+  lval_println(result);
+  int ok = lval_type(result) != LVAL_ERR;
+  lval_del(result);
+  lgc_poll();
+  return ok;
+}
+
+void lmain_exit(void) {
+  if (lgc_stats) {
+    lgc_report();
+    lslab_report();
+  }
+  if (ltier_stats) {
+    ltier_report();
+  }
+}
+
+#ifndef TLISP_NO_MAIN
 int main(int argc, char *argv[]) {
+  lmain_stack(__builtin_frame_address(0));
+  int bench_engines = 0;
+  char const *emit = NULL;
+
+  for (int i = 1; i < argc; i++) {
+    if (lmain_option(argv[i])) {
+      continue;
+    } else if (strcmp(argv[i], "--bench-env") == 0) {
+      lbench_env();
+      return 0;
+    } else if (strcmp(argv[i], "--bench-engines") == 0) {
+      bench_engines = 1;
+    } else if (strcmp(argv[i], "--emit-c") == 0 && i + 1 < argc) {
+      emit = argv[++i];
+    } else {
+      fprintf(stderr, "usage: %s " LMAIN_OPTIONS " "
+              "[--bench-env] [--bench-engines] [--emit-c FILE]\n", argv[0]);
+      return 1;
+    }
+  }
   mpc_parser_t* Number = mpc_new("number");
   mpc_parser_t* Symbol = mpc_new("symbol");
   mpc_parser_t* Sexpr = mpc_new("sexpr");
@@ -735,21 +4447,32 @@ program	 : /^/ <expr>* /$/ ; \
 ",
 	    Number, Symbol, Sexpr, Qexpr, Expr, Program);
 
+  if (bench_engines || emit) {
+    int status = 0;
+    if (bench_engines) {
+      lbench_engines(Program);
+    } else {
+      status = lemit_c(emit, Program);
+    }
+    mpc_cleanup(6, Number, Symbol, Sexpr, Qexpr, Expr, Program);
+    return status;
+  }
+
   puts("TLisp Version 0.01");
   puts("Press Ctrl+c to Exit\n");
 
-  lenv *e = lenv_new();
-  lenv_add_builtins(e);
-  
+  lenv *e = lmain_env();
+
   while (1) {
     char* input = readline("tlisp> ");
+    if (input == NULL) {
+      break;
+    }
     add_history(input);
 
     mpc_result_t r;
     if (mpc_parse("<stdin>", input, Program, &r)) {
-      lval *result = lval_eval(e, lval_read(r.output));
-      lval_println(result);
-      lval_del(result);
+      lmain_line(e, lval_read(r.output));
       //      mpc_ast_print(r.output);
       mpc_ast_delete(r.output);
     } else {
@@ -760,7 +4483,10 @@ program	 : /^/ <expr>* /$/ ; \
     free(input);
   }
 
+  lmain_exit();
+
   mpc_cleanup(6, Number, Symbol, Sexpr, Qexpr, Expr, Program);
 
   return 0;
 }
+#endif